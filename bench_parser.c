@@ -0,0 +1,368 @@
+/* bench_parser.c: HTTP Request Parser Benchmark and Corpus Check */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles()    __rdtsc()
+#else
+#define cycles()    0
+#endif
+
+/* Global Variables (normally defined by spidey.c) */
+
+char  *Port            = "9898";
+char  *MimeTypesPath   = "/etc/mime.types";
+char  *DefaultMimeType = "text/plain";
+char  *RootPath        = "www";
+int    RootFd          = -1;
+bool   ResolveHosts    = false;
+size_t RequestLineMax  = 8192;
+size_t HeaderLineMax   = 8192;
+size_t HeaderBytesMax  = 65536;
+size_t HeaderCountMax  = 100;
+size_t FdCacheSize     = 0;
+
+/* Allocation Counting */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t Allocations = 0;
+
+void *malloc(size_t size)               { Allocations++; return __libc_malloc(size); }
+void *calloc(size_t nmemb, size_t size) { Allocations++; return __libc_calloc(nmemb, size); }
+void *realloc(void *ptr, size_t size)   { Allocations++; return __libc_realloc(ptr, size); }
+
+/* Corpus */
+
+struct sample {
+    const char *name;
+    const char *head;
+    int         status;     /* Expected parse_request result */
+    const char *method;
+    const char *uri;
+    const char *query;
+    int         version;
+    size_t      headers;
+};
+
+static struct sample Corpus[] = {
+    {"curl", "GET / HTTP/1.1\r\n"
+             "Host: localhost:9898\r\n"
+             "User-Agent: curl/7.88.1\r\n"
+             "Accept: */*\r\n"
+             "\r\n",
+     0, "GET", "/", "", 11, 3},
+    {"curl-query", "GET /scripts/cowsay.sh?message=hello+world&template=tux HTTP/1.0\r\n"
+                   "Host: localhost:9898\r\n"
+                   "User-Agent: curl/7.88.1\r\n"
+                   "Accept: */*\r\n"
+                   "\r\n",
+     0, "GET", "/scripts/cowsay.sh", "message=hello+world&template=tux", 10, 3},
+    {"browser", "GET /html/index.html HTTP/1.1\r\n"
+                "Host: student00.cse.nd.edu:9898\r\n"
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+                "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                "Accept-Language: en-US,en;q=0.5\r\n"
+                "Accept-Encoding: gzip, deflate, br\r\n"
+                "Referer: http://student00.cse.nd.edu:9898/html/\r\n"
+                "Connection: keep-alive\r\n"
+                "Cookie: _ga=GA1.1.1822354470.1690000000; _ga_ABCDEF1234=GS1.1.1690000000.1.1.1690000100.0.0.0; "
+                "session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0"
+                "IjoxNTE2MjM5MDIyfQ.SflKxwRJSMeKKF2QT4fwpMeJf36POk6yJV_adQssw5c; theme=dark; lang=en-US; "
+                "consent=analytics%3Dtrue%26ads%3Dfalse%26functional%3Dtrue; csrftoken=4f8a9c2e1b7d6f3a0e5c8b9d2a1f4e7c; "
+                "prefs=%7B%22fontSize%22%3A14%2C%22sidebar%22%3Atrue%2C%22layout%22%3A%22wide%22%7D\r\n"
+                "Upgrade-Insecure-Requests: 1\r\n"
+                "Sec-Fetch-Dest: document\r\n"
+                "Sec-Fetch-Mode: navigate\r\n"
+                "Sec-Fetch-Site: same-origin\r\n"
+                "Sec-Fetch-User: ?1\r\n"
+                "If-Modified-Since: Tue, 15 Aug 2023 20:13:42 GMT\r\n"
+                "If-None-Match: \"1a2b3c-5d-64dbde16\"\r\n"
+                "Cache-Control: max-age=0\r\n"
+                "\r\n",
+     0, "GET", "/html/index.html", "", 11, 16},
+    {"whitespace", "\r\n"
+                   "GET    /text/hackers.txt     HTTP/1.1   \r\n"
+                   "Host:     localhost   \r\n"
+                   "Accept:\t\t*/*\t\r\n"
+                   "X-Folded: first\r\n"
+                   "    second\r\n"
+                   "\t third\r\n"
+                   "X-Empty:\r\n"
+                   "\r\n",
+     0, "GET", "/text/hackers.txt", "", 11, 4},
+    {"bare-lf", "GET /html/ HTTP/1.0\n"
+                "Host: localhost\n"
+                "Accept: */*\n"
+                "\n",
+     0, "GET", "/html/", "", 10, 2},
+    {"malformed", "GET / HTTP/1.1\r\n"
+                  "Host : localhost\r\n"
+                  "\r\n",
+     -1, NULL, NULL, NULL, 0, 0},
+};
+
+#define CORPUS_SIZE (sizeof(Corpus) / sizeof(Corpus[0]))
+
+/* Bytes sent after each head (e.g. a request body), which the parser must
+ * leave alone */
+#define TRAILER	    "name=value"
+
+/* Functions */
+
+/**
+ * Return monotonic time in nanoseconds.
+ **/
+static double
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Verify parsed request against expected sample values.
+ **/
+static bool
+sample_matches(const struct sample *s, struct request *r, int status)
+{
+    size_t headers = 0;
+
+    if (status != s->status) {
+        return false;
+    }
+    if (status < 0) {
+        return true;
+    }
+    for (struct header *h = r->headers; h; h = h->next) {
+        headers++;
+    }
+    return streq(r->method, s->method) && streq(r->uri, s->uri) &&
+           streq(r->query, s->query) && r->version == s->version &&
+           headers == s->headers;
+}
+
+/**
+ * Parse sample (followed by trailer, if not NULL) from socket with
+ * parse_request, and check that the trailer is left buffered.
+ **/
+static int
+sample_parse(const struct sample *s, int sv[2], struct request **r, const char *trailer)
+{
+    size_t length = strlen(s->head);
+    size_t extra  = trailer ? strlen(trailer) : 0;
+    int    status;
+
+    if (write(sv[0], s->head, length) != (ssize_t)length ||
+        (extra && write(sv[0], trailer, extra) != (ssize_t)extra)) {
+        fprintf(stderr, "write: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    *r = calloc(1, sizeof(struct request));
+    (*r)->fd     = sv[1];
+    (*r)->pathfd = -1;
+    conn_init(&(*r)->conn, sv[1]);
+    status = parse_request(*r);
+
+    /* The trailer must still be buffered (or unread) after the head */
+    if (status == 0 && extra) {
+        struct conn *c = &(*r)->conn;
+        char   rest[sizeof(TRAILER)];
+        size_t buffered = c->rlen - c->rpos;
+        ssize_t nread = 0;
+
+        memcpy(rest, c->rbuf + c->rpos, buffered < extra ? buffered : extra);
+        if (buffered < extra) {
+            nread = recv(sv[1], rest + buffered, extra - buffered, MSG_DONTWAIT);
+        }
+        if (buffered > extra || buffered + (nread > 0 ? nread : 0) != extra || memcmp(rest, trailer, extra) != 0) {
+            status = -2;
+        }
+    }
+
+    /* Drain whatever the parser did not consume (e.g. after an error) */
+    char buffer[BUFSIZ];
+    while (recv(sv[1], buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+
+    (*r)->fd = -1;
+    return status;
+}
+
+/**
+ * Feed sample followed by TRAILER to parser in chunks of n bytes.
+ *
+ * Returns 0 if the head was parsed and exactly its bytes were consumed, -1 on
+ * a parse error, and -2 if the parser consumed trailing bytes (or too few).
+ **/
+static int
+sample_feed(const struct sample *s, struct request *r, size_t n)
+{
+    char   input[BUFSIZ];
+    size_t length = snprintf(input, sizeof(input), "%s%s", s->head, TRAILER);
+    size_t offset = 0;
+    size_t used   = 0;
+    parse_status status = PARSE_NEED_MORE;
+
+    while (offset < length && status == PARSE_NEED_MORE) {
+        size_t chunk = length - offset < n ? length - offset : n;
+
+        status  = parser_feed(&r->parser, r, input + offset, chunk, &used);
+        offset += used;
+    }
+    if (status != PARSE_DONE) {
+        return -1;
+    }
+    return offset == strlen(s->head) ? 0 : -2;
+}
+
+/* Chunk sizes samples are fed to the parser in (0 for all at once) */
+static const size_t Chunks[] = {1, 3, 0};
+
+/**
+ * Check every corpus sample, from a socket and fed in chunks of one byte,
+ * three bytes, and all at once, each followed by trailing bytes that must
+ * not be consumed.
+ **/
+static int
+check_corpus(int sv[2])
+{
+    int failures = 0;
+
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        struct sample  *s = &Corpus[i];
+        struct request *r;
+        bool ok;
+
+        int status = sample_parse(s, sv, &r, TRAILER);
+        ok = sample_matches(s, r, status);
+        free_request(r);
+
+        for (size_t k = 0; k < sizeof(Chunks) / sizeof(Chunks[0]); k++) {
+            r = calloc(1, sizeof(struct request));
+            r->fd = r->pathfd = -1;
+            ok = sample_matches(s, r, sample_feed(s, r, Chunks[k] ? Chunks[k] : BUFSIZ)) && ok;
+            free_request(r);
+        }
+
+        printf("%-12s %s\n", s->name, ok ? "ok" : "FAILED");
+        failures += !ok;
+    }
+    return failures;
+}
+
+/**
+ * Benchmark every corpus sample.
+ **/
+static void
+bench_corpus(int sv[2], size_t iterations)
+{
+    int stderr_fd = dup(STDERR_FILENO);
+    int null_fd   = open("/dev/null", O_WRONLY);
+
+    printf("%-12s %8s %12s %12s %12s\n", "sample", "bytes", "ns/request", "bytes/cycle", "allocs/req");
+    fflush(stdout);
+
+    /* Silence parse error messages while timing */
+    dup2(null_fd, STDERR_FILENO);
+
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        struct sample  *s = &Corpus[i];
+        struct request *r;
+        size_t   length = strlen(s->head);
+        size_t   allocations;
+        uint64_t start_cycles;
+        uint64_t total_cycles;
+        double   start_ns;
+        double   total_ns;
+
+        allocations  = Allocations;
+        start_ns     = now_ns();
+        start_cycles = cycles();
+        for (size_t n = 0; n < iterations; n++) {
+            sample_parse(s, sv, &r, NULL);
+            free_request(r);
+        }
+        total_cycles = cycles() - start_cycles;
+        total_ns     = now_ns() - start_ns;
+        allocations  = Allocations - allocations;
+
+        printf("%-12s %8zu %12.1f %12.3f %12.2f\n", s->name, length,
+            total_ns / iterations,
+            total_cycles ? (double)length * iterations / total_cycles : 0.0,
+            (double)allocations / iterations);
+        fflush(stdout);
+    }
+
+    dup2(stderr_fd, STDERR_FILENO);
+    close(stderr_fd);
+    close(null_fd);
+}
+
+/**
+ * Display usage message.
+ */
+static void
+usage(const char *progname, int status)
+{
+    fprintf(stderr, "Usage: %s [-c] [-n iterations]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c            Only check corpus (exit status reports failures)\n");
+    fprintf(stderr, "    -n iterations Requests to parse per sample (100000)\n");
+    exit(status);
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t iterations = 100000;
+    bool   check_only = false;
+    int    sv[2];
+    int    c;
+
+    while ((c = getopt(argc, argv, "hcn:")) != -1) {
+        switch (c) {
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'c':
+                check_only = true;
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (check_corpus(sv) > 0) {
+        return EXIT_FAILURE;
+    }
+    if (!check_only && iterations > 0) {
+        bench_corpus(sv, iterations);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,225 @@
+/* bench_sendfile.c: Static File Body Transfer Benchmark */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MEGABYTE    (1024.0 * 1024.0)
+#define GIGABYTE    (1024.0 * 1024.0 * 1024.0)
+
+/* Benchmark Methods */
+
+typedef ssize_t (*send_method)(struct conn *c, int fd, off_t *offset, size_t count);
+
+/**
+ * Copy file to connection through a BUFSIZ user space buffer (the way the
+ * file handler used to).
+ **/
+static ssize_t
+send_copy(struct conn *c, int fd, off_t *offset, size_t count)
+{
+    char buffer[BUFSIZ];
+    ssize_t nread;
+
+    count = count < sizeof(buffer) ? count : sizeof(buffer);
+    if ((nread = pread(fd, buffer, count, *offset)) > 0) {
+        *offset += nread;
+        if (conn_write(c, buffer, nread) < 0) {
+            return -1;
+        }
+    }
+    return nread;
+}
+
+static struct {
+    const char *name;
+    send_method method;
+} Methods[] = {
+    {"copy",        send_copy},
+    {"sendfile",    conn_sendfile},
+};
+
+/* Functions */
+
+/**
+ * Return specified clock in seconds.
+ **/
+static double
+now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Drain and discard everything from the receiving end of the socket.
+ **/
+static void *
+drain_thread(void *arg)
+{
+    int  fd = *(int *)arg;
+    char buffer[1 << 16];
+
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+/**
+ * Parse size with optional K, M, or G suffix.
+ **/
+static size_t
+parse_size(const char *s)
+{
+    char  *end;
+    size_t size = strtoull(s, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': return size << 10;
+        case 'm': case 'M': return size << 20;
+        case 'g': case 'G': return size << 30;
+        default:            return size;
+    }
+}
+
+/**
+ * Create temporary file of specified size filled with text.
+ **/
+static int
+create_file(const char *directory, size_t size)
+{
+    char path[BUFSIZ];
+    char block[1 << 16];
+    int  fd;
+
+    snprintf(path, sizeof(path), "%s/bench_sendfile.XXXXXX", directory);
+    if ((fd = mkstemp(path)) < 0) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = 'a' + i % 26;
+    }
+    for (size_t written = 0; written < size; ) {
+        size_t  n = size - written < sizeof(block) ? size - written : sizeof(block);
+        ssize_t nwritten = write(fd, block, n);
+        if (nwritten < 0) {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        written += nwritten;
+    }
+    return fd;
+}
+
+/**
+ * Send file repeatedly (at least total bytes) with method and report
+ * throughput and sender CPU time per gigabyte.
+ **/
+static void
+bench_method(const char *name, send_method method, int fd, size_t size, size_t total)
+{
+    struct conn c;
+    pthread_t   thread;
+    int         sv[2];
+    size_t      iterations = total / size ? total / size : 1;
+    double      wall;
+    double      cpu;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pthread_create(&thread, NULL, drain_thread, &sv[1]);
+    conn_init(&c, sv[0]);
+
+    wall = now(CLOCK_MONOTONIC);
+    cpu  = now(CLOCK_THREAD_CPUTIME_ID);
+    for (size_t i = 0; i < iterations; i++) {
+        off_t offset = 0;
+        while ((size_t)offset < size && method(&c, fd, &offset, size - offset) > 0);
+        conn_flush(&c);
+    }
+    cpu  = now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wall = now(CLOCK_MONOTONIC) - wall;
+
+    close(sv[0]);
+    pthread_join(thread, NULL);
+    close(sv[1]);
+
+    double bytes = (double)size * iterations;
+    printf("%-10s %12zu %10zu %12.1f %14.3f\n", name, size, iterations,
+        bytes / MEGABYTE / wall, cpu / (bytes / GIGABYTE));
+}
+
+/**
+ * Display usage message.
+ */
+static void
+usage(const char *progname, int status)
+{
+    fprintf(stderr, "Usage: %s [-d directory] [-t total] [sizes...]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -d directory  Directory for temporary files (/tmp)\n");
+    fprintf(stderr, "    -t total      Bytes to send per size and method (1G)\n");
+    fprintf(stderr, "Sizes accept K, M, and G suffixes (default: 1K 1M 1G)\n");
+    exit(status);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *directory = "/tmp";
+    const char *defaults[] = {"1K", "1M", "1G"};
+    const char **sizes = defaults;
+    int    nsizes = sizeof(defaults) / sizeof(defaults[0]);
+    size_t total  = 1UL << 30;
+    int    c;
+
+    while ((c = getopt(argc, argv, "hd:t:")) != -1) {
+        switch (c) {
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'd':
+                directory = optarg;
+                break;
+            case 't':
+                total = parse_size(optarg);
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+    }
+    if (optind < argc) {
+        sizes  = (const char **)&argv[optind];
+        nsizes = argc - optind;
+    }
+
+    printf("%-10s %12s %10s %12s %14s\n", "method", "size", "iterations", "MB/s", "CPU s/GB");
+    for (int i = 0; i < nsizes; i++) {
+        size_t size = parse_size(sizes[i]);
+        int    fd   = create_file(directory, size);
+
+        for (size_t m = 0; m < sizeof(Methods) / sizeof(Methods[0]); m++) {
+            bench_method(Methods[m].name, Methods[m].method, fd, size, total);
+        }
+        close(fd);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,384 @@
+/* cache.c: Hot File Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_BUCKETS	    4096		/* Hash table buckets */
+#define CACHE_FILE_MAX	    (4 * 1024 * 1024)	/* Larger files are sent with sendfile */
+#define CACHE_ENTRY_SHARE   4			/* Largest entry is 1/4 of budget */
+
+/* Internal Variables */
+
+static struct cache_entry *Buckets[CACHE_BUCKETS];	/* Read lock-free */
+static struct cache_entry *Clock = NULL;		/* CLOCK ring (writers only) */
+static struct cache_entry *Retired = NULL;		/* Unlinked, awaiting free */
+static size_t		   Bytes = 0;			/* Bytes held by live entries */
+static size_t		   Readers = 0;			/* Lookups in progress */
+static size_t		   Hits = 0;
+static size_t		   Misses = 0;
+static pthread_mutex_t	   Lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Internal Functions */
+
+/**
+ * Hash key (FNV-1a).
+ **/
+static size_t
+cache_hash(const char *key)
+{
+    size_t hash = 2166136261u;
+
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Return whether entry is still valid for file status (and has not expired).
+ **/
+static bool
+cache_valid(const struct cache_entry *e, const struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec  == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           (e->expires == 0 || e->expires > time(NULL));
+}
+
+/**
+ * Free entry memory.
+ **/
+static void
+cache_free(struct cache_entry *e)
+{
+    free(e->data);
+    free(e->type);
+    free(e->key);
+    free(e);
+}
+
+/**
+ * Free retired entries that nobody references (must hold Lock).
+ *
+ * Retired entries are already unlinked from the hash table, so once no
+ * lookup is in progress, no reader can find them anymore and they may be
+ * freed as soon as their reference count drops to zero.
+ **/
+static void
+cache_reclaim(void)
+{
+    struct cache_entry **p = &Retired;
+
+    if (__atomic_load_n(&Readers, __ATOMIC_SEQ_CST) > 0) {
+        return;
+    }
+
+    while (*p) {
+        struct cache_entry *e = *p;
+        if (__atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) == 0) {
+            *p = e->retired;
+            cache_free(e);
+        } else {
+            p = &e->retired;
+        }
+    }
+}
+
+/**
+ * Unlink entry from hash table and CLOCK ring, drop the cache's reference,
+ * and retire it (must hold Lock).
+ **/
+static void
+cache_unlink(struct cache_entry *e)
+{
+    struct cache_entry **p = &Buckets[e->hash % CACHE_BUCKETS];
+
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    __atomic_store_n(p, e->next, __ATOMIC_SEQ_CST);
+
+    if (e->clock_next == e) {
+        Clock = NULL;
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (Clock == e) {
+            Clock = e->clock_next;
+        }
+    }
+
+    Bytes     -= e->length;
+    e->retired = Retired;
+    Retired    = e;
+    __atomic_sub_fetch(&e->refs, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Evict entries with the CLOCK algorithm until size more bytes fit within
+ * the budget (must hold Lock).
+ *
+ * The hand sweeps the ring: recently referenced entries get a second chance
+ * (their bit is cleared), unreferenced ones are evicted.
+ **/
+static void
+cache_evict(size_t size)
+{
+    while (Clock && Bytes + size > CacheSize) {
+        struct cache_entry *e = Clock;
+
+        Clock = e->clock_next;
+        if (__atomic_exchange_n(&e->referenced, false, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        cache_unlink(e);
+    }
+}
+
+/* Functions */
+
+/**
+ * Lookup cached entry for key that is still valid for file status.
+ *
+ * This never takes a lock, so it may be called concurrently from any number
+ * of threads.  On a hit, a reference is taken on the entry, which must be
+ * dropped with cache_release once its data is no longer needed.
+ *
+ * Returns entry on hit, NULL on miss.
+ **/
+struct cache_entry *
+cache_lookup(const char *key, const struct stat *st)
+{
+    struct cache_entry *e;
+    size_t hash = cache_hash(key);
+
+    if (CacheSize == 0) {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&Readers, 1, __ATOMIC_SEQ_CST);
+    for (e = __atomic_load_n(&Buckets[hash % CACHE_BUCKETS], __ATOMIC_ACQUIRE);
+         e != NULL;
+         e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE)) {
+        if (e->hash == hash && streq(e->key, key)) {
+            break;
+        }
+    }
+    if (e && cache_valid(e, st)) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&e->referenced, true, __ATOMIC_RELAXED);
+    } else {
+        e = NULL;
+    }
+    __atomic_sub_fetch(&Readers, 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(e ? &Hits : &Misses, 1, __ATOMIC_RELAXED);
+    return e;
+}
+
+/**
+ * Determine whether an entry of length bytes may be cached at all (entries
+ * larger than CACHE_FILE_MAX or a share of the budget are never cached).
+ **/
+bool
+cache_fits(size_t length)
+{
+    return CacheSize > 0 && length > 0 && length <= CACHE_FILE_MAX &&
+           length <= CacheSize / CACHE_ENTRY_SHARE;
+}
+
+/**
+ * Publish entry under key (must not hold Lock).
+ *
+ * Older entries are evicted to make room, and any stale entry for the same
+ * key is replaced.
+ **/
+static void
+cache_publish(struct cache_entry *e)
+{
+    struct cache_entry *old;
+
+    pthread_mutex_lock(&Lock);
+
+    /* Replace existing entry for key */
+    for (old = Buckets[e->hash % CACHE_BUCKETS]; old; old = old->next) {
+        if (old->hash == e->hash && streq(old->key, e->key)) {
+            cache_unlink(old);
+            break;
+        }
+    }
+
+    /* Make room and insert into CLOCK ring (behind the hand) */
+    cache_evict(e->length);
+    if (Clock) {
+        e->clock_next = Clock;
+        e->clock_prev = Clock->clock_prev;
+        Clock->clock_prev->clock_next = e;
+        Clock->clock_prev = e;
+    } else {
+        e->clock_next = e->clock_prev = e;
+        Clock = e;
+    }
+    Bytes += e->length;
+
+    /* Publish to readers */
+    e->next = Buckets[e->hash % CACHE_BUCKETS];
+    __atomic_store_n(&Buckets[e->hash % CACHE_BUCKETS], e, __ATOMIC_RELEASE);
+
+    cache_reclaim();
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Initialize entry validators and key, with references for the cache and
+ * the caller.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+cache_prepare(struct cache_entry *e, const char *key, const struct stat *st, const char *type)
+{
+    if ((e->key = strdup(key)) == NULL || (type && (e->type = strdup(type)) == NULL)) {
+        return -1;
+    }
+    e->hash   = cache_hash(key);
+    e->dev    = st->st_dev;
+    e->ino    = st->st_ino;
+    e->size   = st->st_size;
+    e->mtime  = st->st_mtim;
+    e->refs   = 2;          /* Cache and caller */
+    return 0;
+}
+
+/**
+ * Load file into cache under key.
+ *
+ * The contents are copied into memory rather than mmap'd, since a file
+ * truncated in place while its mapping is being sent would raise SIGBUS.
+ * Files larger than CACHE_FILE_MAX or too large for the budget (and
+ * non-regular files) are not cached, and are sent with sendfile instead.
+ * Older entries are evicted to make room, and any stale entry for the same
+ * key is replaced.  The type is stored with the entry (e.g. the mimetype)
+ * and may be NULL.
+ *
+ * Returns entry (with a reference taken, see cache_lookup) on success, NULL
+ * if the file cannot be cached.
+ **/
+struct cache_entry *
+cache_insert(const char *key, const struct stat *st, int fd, const char *type)
+{
+    struct cache_entry *e;
+    size_t length = st->st_size;
+
+    if (!S_ISREG(st->st_mode) || !cache_fits(length)) {
+        return NULL;
+    }
+
+    /* Load file contents (outside of the lock) */
+    if ((e = calloc(1, sizeof(struct cache_entry))) == NULL) {
+        return NULL;
+    }
+    if ((e->data = malloc(length ? length : 1)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    for (size_t offset = 0; offset < length; ) {
+        ssize_t nread = pread(fd, e->data + offset, length - offset, offset);
+        if (nread <= 0) {
+            debug("Unable to read %s: %s", key, nread < 0 ? strerror(errno) : "short read");
+            free(e->data);
+            free(e);
+            return NULL;
+        }
+        offset += nread;
+    }
+    e->length = length;
+    if (cache_prepare(e, key, st, type) < 0) {
+        cache_free(e);
+        return NULL;
+    }
+
+    cache_publish(e);
+    return e;
+}
+
+/**
+ * Insert data derived from a file (e.g. a compressed variant or the output of
+ * a CGI script) into cache under key, validated by the file's status.  If
+ * expires is not 0, the entry is no longer valid from that time on.
+ *
+ * The cache takes ownership of data (which must have been malloc'd), even if
+ * it cannot be cached, in which case it is free'd.
+ *
+ * Returns entry (with a reference taken, see cache_lookup) on success, NULL
+ * if the data cannot be cached.
+ **/
+struct cache_entry *
+cache_insert_data(const char *key, const struct stat *st, char *data, size_t length, const char *type, time_t expires)
+{
+    struct cache_entry *e;
+
+    if (!cache_fits(length) || (e = calloc(1, sizeof(struct cache_entry))) == NULL) {
+        free(data);
+        return NULL;
+    }
+    e->data    = data;
+    e->length  = length;
+    e->expires = expires;
+    if (cache_prepare(e, key, st, type) < 0) {
+        cache_free(e);
+        return NULL;
+    }
+
+    cache_publish(e);
+    return e;
+}
+
+/**
+ * Release reference to entry taken by cache_lookup or cache_insert.
+ **/
+void
+cache_release(struct cache_entry *e)
+{
+    if (e == NULL) {
+        return;
+    }
+
+    /* Last reference to an evicted entry: try to free it now */
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_RELEASE) == 0 && pthread_mutex_trylock(&Lock) == 0) {
+        cache_reclaim();
+        pthread_mutex_unlock(&Lock);
+    }
+}
+
+/**
+ * Write cache statistics to connection as plain text.
+ **/
+void
+cache_write_status(struct conn *c)
+{
+    size_t hits   = __atomic_load_n(&Hits, __ATOMIC_RELAXED);
+    size_t misses = __atomic_load_n(&Misses, __ATOMIC_RELAXED);
+    size_t bytes;
+
+    pthread_mutex_lock(&Lock);
+    bytes = Bytes;
+    pthread_mutex_unlock(&Lock);
+
+    conn_printf(c, "cache.bytes %zu\n", bytes);
+    conn_printf(c, "cache.budget %zu\n", CacheSize);
+    conn_printf(c, "cache.hits %zu\n", hits);
+    conn_printf(c, "cache.misses %zu\n", misses);
+    conn_printf(c, "cache.hit_ratio %.4f\n", hits + misses ? (double)hits / (hits + misses) : 0.0);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,198 @@
+/* compress.c: On-the-fly Response Compression */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define COMPRESS_WINDOW	    15			/* zlib window bits */
+#define COMPRESS_MEMLEVEL   8			/* zlib memory level */
+
+/* Content types that are already compressed (prefix matches) */
+static const char *Compressed[] = {
+    "image/", "audio/", "video/", "font/woff",
+    "application/gzip", "application/x-gzip", "application/zip",
+    "application/x-bzip2", "application/x-xz", "application/zstd",
+    "application/x-7z-compressed", "application/x-rar-compressed",
+    "application/pdf", "application/octet-stream",
+};
+
+/* Content types that are compressible despite the prefixes above */
+static const char *Compressible[] = {
+    "image/svg+xml", "image/x-icon", "image/bmp",
+};
+
+/* Internal Functions */
+
+/**
+ * Initialize zlib stream for content coding (gzip or deflate).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+compress_init(z_stream *z, const char *coding)
+{
+    int window = streq(coding, "gzip") ? COMPRESS_WINDOW + 16 : COMPRESS_WINDOW;
+
+    memset(z, 0, sizeof(*z));
+    if (deflateInit2(z, CompressLevel, Z_DEFLATED, window, COMPRESS_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        debug("Unable to initialize zlib: %s", z->msg ? z->msg : "unknown error");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Deflate pending input and write the output to the connection.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+compress_deflate(struct compressor *z, int flush)
+{
+    int status;
+
+    do {
+        z->stream.next_out  = (Bytef *)z->out;
+        z->stream.avail_out = sizeof(z->out);
+        if ((status = deflate(&z->stream, flush)) == Z_STREAM_ERROR) {
+            return -1;
+        }
+        if (conn_write(z->conn, z->out, sizeof(z->out) - z->stream.avail_out) < 0) {
+            return -1;
+        }
+    } while (z->stream.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+
+    return 0;
+}
+
+/* Functions */
+
+/**
+ * Select content coding for on-the-fly compression from Accept-Encoding value
+ * (which may be NULL).
+ *
+ * Returns "gzip" or "deflate", or NULL if the client accepts neither (or
+ * compression is disabled).
+ **/
+const char *
+compress_coding(const char *accept)
+{
+    if (CompressLevel == 0 || accept == NULL) {
+        return NULL;
+    }
+    if (accepts_encoding(accept, "gzip")) {
+        return "gzip";
+    }
+    if (accepts_encoding(accept, "deflate")) {
+        return "deflate";
+    }
+    return NULL;
+}
+
+/**
+ * Determine whether content type is worth compressing (i.e. it is not an
+ * already compressed format such as images, archives, or media).
+ **/
+bool
+compress_type(const char *type)
+{
+    if (type == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(Compressible) / sizeof(Compressible[0]); i++) {
+        if (strncasecmp(type, Compressible[i], strlen(Compressible[i])) == 0) {
+            return true;
+        }
+    }
+    for (size_t i = 0; i < sizeof(Compressed) / sizeof(Compressed[0]); i++) {
+        if (strncasecmp(type, Compressed[i], strlen(Compressed[i])) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Compress buffer with content coding in one go.
+ *
+ * Returns newly allocated compressed data (and sets length) on success, NULL
+ * on error.  The data must later be free'd.
+ **/
+char *
+compress_buffer(const void *data, size_t n, const char *coding, size_t *length)
+{
+    z_stream z;
+    char    *out;
+    size_t   capacity;
+
+    if (compress_init(&z, coding) < 0) {
+        return NULL;
+    }
+
+    capacity = deflateBound(&z, n);
+    if ((out = malloc(capacity)) == NULL) {
+        deflateEnd(&z);
+        return NULL;
+    }
+
+    z.next_in   = (Bytef *)data;
+    z.avail_in  = n;
+    z.next_out  = (Bytef *)out;
+    z.avail_out = capacity;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&z);
+        free(out);
+        return NULL;
+    }
+
+    *length = capacity - z.avail_out;
+    deflateEnd(&z);
+    return out;
+}
+
+/**
+ * Start compressing output to connection with content coding.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+compress_start(struct compressor *z, struct conn *c, const char *coding)
+{
+    z->conn = c;
+    return compress_init(&z->stream, coding);
+}
+
+/**
+ * Compress data to connection.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+compress_write(struct compressor *z, const void *data, size_t n)
+{
+    z->stream.next_in  = (Bytef *)data;
+    z->stream.avail_in = n;
+    return compress_deflate(z, Z_NO_FLUSH);
+}
+
+/**
+ * Finish compressed stream (writing the trailer) and release its state.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+compress_finish(struct compressor *z)
+{
+    int status;
+
+    z->stream.next_in  = NULL;
+    z->stream.avail_in = 0;
+    status = compress_deflate(z, Z_FINISH);
+    deflateEnd(&z->stream);
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
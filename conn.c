@@ -0,0 +1,341 @@
+/* conn.c: Buffered Connection I/O */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Internal Declarations */
+
+static int  conn_queue(struct conn *c, const void *data, size_t n);
+static void conn_commit(struct conn *c, size_t n);
+
+/**
+ * Initialize connection buffers for file descriptor.
+ *
+ * The descriptor may be blocking or non-blocking.  On a non-blocking
+ * descriptor, conn_fill and conn_flush fail with errno set to EAGAIN when
+ * they cannot make progress and may simply be called again later.
+ **/
+void
+conn_init(struct conn *c, int fd)
+{
+    c->fd     = fd;
+    c->rpos   = 0;
+    c->rlen   = 0;
+    c->wlen   = 0;
+    c->iovcnt = 0;
+    c->iovpos = 0;
+}
+
+/**
+ * Read more data from the connection into the read-ahead buffer.
+ *
+ * Unconsumed data is first moved to the front of the buffer.  Returns the
+ * number of bytes read, 0 on end of file (or if the buffer is full), and -1
+ * on error.
+ **/
+ssize_t
+conn_fill(struct conn *c)
+{
+    ssize_t nread;
+
+    if (c->rpos > 0) {
+        memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+        c->rlen -= c->rpos;
+        c->rpos  = 0;
+    }
+
+    if (c->rlen == sizeof(c->rbuf)) {
+        return 0;
+    }
+
+    do {
+        nread = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread > 0) {
+        c->rlen += nread;
+    }
+    return nread;
+}
+
+/**
+ * Read up to n bytes from the connection, draining the read-ahead buffer
+ * before reading from the descriptor.
+ *
+ * Returns the number of bytes read, 0 on end of file, and -1 on error.
+ **/
+ssize_t
+conn_read(struct conn *c, void *data, size_t n)
+{
+    size_t buffered = c->rlen - c->rpos;
+    ssize_t nread;
+
+    if (buffered > 0) {
+        n = n < buffered ? n : buffered;
+        memcpy(data, c->rbuf + c->rpos, n);
+        c->rpos += n;
+        return n;
+    }
+
+    do {
+        nread = read(c->fd, data, n);
+    } while (nread < 0 && errno == EINTR);
+    return nread;
+}
+
+/**
+ * Append iovec to pending output (flushing if the gather list is full).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+conn_queue(struct conn *c, const void *data, size_t n)
+{
+    if (c->iovcnt == CONN_IOV_MAX && conn_flush(c) < 0) {
+        return -1;
+    }
+    c->iov[c->iovcnt].iov_base = (void *)data;
+    c->iov[c->iovcnt].iov_len  = n;
+    c->iovcnt++;
+    return 0;
+}
+
+/**
+ * Commit n bytes placed at the tail of the output buffer to pending output.
+ *
+ * The caller must ensure there is room in the gather list.
+ **/
+static void
+conn_commit(struct conn *c, size_t n)
+{
+    struct iovec *last = c->iovcnt ? &c->iov[c->iovcnt - 1] : NULL;
+
+    /* Extend last iovec if it ends at the tail of the output buffer */
+    if (last && (char *)last->iov_base + last->iov_len == c->wbuf + c->wlen) {
+        last->iov_len += n;
+    } else {
+        c->iov[c->iovcnt].iov_base = c->wbuf + c->wlen;
+        c->iov[c->iovcnt].iov_len  = n;
+        c->iovcnt++;
+    }
+    c->wlen += n;
+}
+
+/**
+ * Write data to the connection.
+ *
+ * Data is copied into the output buffer (flushing as necessary), so the
+ * caller's memory may be reused immediately.  Writes larger than the output
+ * buffer are flushed directly from the caller's memory.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+conn_write(struct conn *c, const void *data, size_t n)
+{
+    if (n > sizeof(c->wbuf) - c->wlen || c->iovcnt == CONN_IOV_MAX) {
+        if (conn_flush(c) < 0) {
+            return -1;
+        }
+        if (n > sizeof(c->wbuf)) {
+            struct iovec iov = {(void *)data, n};
+            return conn_writev(c, &iov, 1);
+        }
+    }
+
+    memcpy(c->wbuf + c->wlen, data, n);
+    conn_commit(c, n);
+    return 0;
+}
+
+/**
+ * Write formatted string to the connection.
+ *
+ * The string is formatted directly into the output buffer when it fits.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+conn_printf(struct conn *c, const char *format, ...)
+{
+    va_list args;
+    char   *data;
+    int     n;
+    int     status;
+
+    if (c->iovcnt == CONN_IOV_MAX && conn_flush(c) < 0) {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_start(args, format);
+        n = vsnprintf(c->wbuf + c->wlen, sizeof(c->wbuf) - c->wlen, format, args);
+        va_end(args);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < sizeof(c->wbuf) - c->wlen) {
+            conn_commit(c, n);
+            return 0;
+        }
+        if (c->wlen == 0 || conn_flush(c) < 0) {
+            break;
+        }
+    }
+
+    /* Too large for the output buffer: format into temporary memory */
+    va_start(args, format);
+    n = vasprintf(&data, format, args);
+    va_end(args);
+    if (n < 0) {
+        return -1;
+    }
+    status = conn_write(c, data, n);
+    free(data);
+    return status;
+}
+
+/**
+ * Queue caller-owned iovecs after any pending output and flush everything
+ * with writev(2).
+ *
+ * The caller's memory is referenced, not copied, so it must remain valid
+ * until the flush completes (on a non-blocking descriptor, until conn_flush
+ * returns 0).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+conn_writev(struct conn *c, const struct iovec *iov, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (iov[i].iov_len > 0 && conn_queue(c, iov[i].iov_base, iov[i].iov_len) < 0) {
+            return -1;
+        }
+    }
+    return conn_flush(c);
+}
+
+/**
+ * Flush pending output with writev(2).
+ *
+ * Partial writes are resumed where they left off.  Returns 0 once all pending
+ * output has been written, -1 on error (errno EAGAIN on a non-blocking
+ * descriptor that is not writable; call again to resume).
+ **/
+int
+conn_flush(struct conn *c)
+{
+    while (c->iovpos < c->iovcnt) {
+        int     count = c->iovcnt - c->iovpos;
+        ssize_t nwritten;
+
+        nwritten = writev(c->fd, c->iov + c->iovpos, count < IOV_MAX ? count : IOV_MAX);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        /* Advance past written iovecs */
+        while (nwritten > 0) {
+            struct iovec *iov = &c->iov[c->iovpos];
+            if ((size_t)nwritten >= iov->iov_len) {
+                nwritten -= iov->iov_len;
+                c->iovpos++;
+            } else {
+                iov->iov_base  = (char *)iov->iov_base + nwritten;
+                iov->iov_len  -= nwritten;
+                nwritten = 0;
+            }
+        }
+    }
+
+    c->wlen   = 0;
+    c->iovcnt = 0;
+    c->iovpos = 0;
+    return 0;
+}
+
+/**
+ * Send up to count bytes from file descriptor fd to the connection without
+ * copying through user space.
+ *
+ * Any pending output is flushed first.  Regular files are sent with
+ * sendfile(2) starting at *offset (which is advanced; the file position is
+ * left untouched, so descriptors may be shared between requests).  Pipes
+ * (offset must be NULL) are moved with splice(2).  If neither works for fd,
+ * the data is copied through the output buffer instead.
+ *
+ * Returns the number of bytes sent (which may be less than count), 0 at end
+ * of file, and -1 on error (errno EAGAIN on a non-blocking descriptor that
+ * is not writable; call again to resume).
+ **/
+ssize_t
+conn_sendfile(struct conn *c, int fd, off_t *offset, size_t count)
+{
+    ssize_t nsent;
+
+    if (conn_flush(c) < 0) {
+        return -1;
+    }
+
+    do {
+        nsent = sendfile(c->fd, fd, offset, count);
+    } while (nsent < 0 && errno == EINTR);
+
+    if (nsent < 0 && errno == EINVAL) {
+        do {
+            nsent = splice(fd, offset, c->fd, NULL, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } while (nsent < 0 && errno == EINTR);
+    }
+
+    if (nsent < 0 && errno == EINVAL) {
+        char buffer[CONN_BUFSIZ];
+
+        count = count < sizeof(buffer) ? count : sizeof(buffer);
+        nsent = offset ? pread(fd, buffer, count, *offset) : read(fd, buffer, count);
+        if (nsent > 0) {
+            if (offset) {
+                *offset += nsent;
+            }
+            if (conn_write(c, buffer, nsent) < 0 || conn_flush(c) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return nsent;
+}
+
+/**
+ * Wait until the connection is ready for the specified poll(2) events (e.g.
+ * POLLOUT after a write on a non-blocking descriptor fails with EAGAIN).
+ *
+ * Returns 0 when ready, -1 on error.
+ **/
+int
+conn_wait(struct conn *c, short events)
+{
+    struct pollfd pfd = {.fd = c->fd, .events = events};
+    int status;
+
+    do {
+        status = poll(&pfd, 1, -1);
+    } while (status < 0 && errno == EINTR);
+
+    return status < 0 ? -1 : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,725 @@
+/* fastcgi.c: Persistent FastCGI Worker Pools */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FASTCGI_POOLS_MAX	    16		/* Pools that may be configured */
+#define FASTCGI_WORKERS_MAX	    64		/* Workers per pool */
+#define FASTCGI_BACKLOG		    128		/* Pending connections per worker */
+#define FASTCGI_TICK		    (20 * 1000000)	/* Manager poll interval (ns) */
+#define FASTCGI_RECORD_MAX	    65535	/* Largest record content */
+
+/* FastCGI record types and roles (https://fast-cgi.github.io/spec) */
+
+#define FCGI_VERSION_1		    1
+#define FCGI_BEGIN_REQUEST	    1
+#define FCGI_END_REQUEST	    3
+#define FCGI_PARAMS		    4
+#define FCGI_STDIN		    5
+#define FCGI_STDOUT		    6
+#define FCGI_STDERR		    7
+#define FCGI_RESPONDER		    1
+#define FCGI_REQUEST_ID		    1
+
+struct fcgi_header {
+    unsigned char version;
+    unsigned char type;
+    unsigned char request_id[2];
+    unsigned char content_length[2];
+    unsigned char padding_length;
+    unsigned char reserved;
+};
+
+/* Internal Structures */
+
+struct fastcgi_worker {		/* Shared between all server processes */
+    pid_t  pid;			/* Worker process (0 if not running) */
+    size_t inflight;		/* Requests dispatched and not finished */
+    size_t requests;		/* Requests finished since (re)spawn */
+    bool   retiring;		/* Recycle once idle (no new requests) */
+};
+
+struct fastcgi_pool {
+    char		  *key;		/* Script path relative to RootPath */
+    char		  *path;	/* Absolute script path */
+    size_t		   size;	/* Number of workers */
+    size_t		   max_requests;/* Recycle workers after this many (0 never) */
+    int			   listen[FASTCGI_WORKERS_MAX];	/* Listening sockets (manager) */
+    struct sockaddr_un	   address[FASTCGI_WORKERS_MAX];/* Worker socket addresses */
+    struct fastcgi_worker *workers;	/* Worker state (shared memory) */
+    size_t		  *next;	/* Round-robin position (shared memory) */
+    size_t		  *respawns;	/* Workers restarted after exiting (shared) */
+    size_t		  *recycles;	/* Workers recycled after max_requests (shared) */
+};
+
+/* Internal Variables */
+
+static struct fastcgi_pool Pools[FASTCGI_POOLS_MAX];
+static size_t		   PoolsCount = 0;
+static char		   SocketDirectory[] = "/tmp/spidey-fastcgi-XXXXXX";
+static volatile sig_atomic_t Stopping = 0;
+
+/* Internal Functions */
+
+/**
+ * Spawn worker process for pool with its listening socket as descriptor 0
+ * (as FastCGI applications expect).
+ **/
+static void
+fastcgi_spawn(struct fastcgi_pool *pool, size_t i)
+{
+    pid_t pid;
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Unable to fork FastCGI worker: %s\n", strerror(errno));
+        return;
+    }
+
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(pool->listen[i], STDIN_FILENO);
+#ifdef SYS_close_range
+        syscall(SYS_close_range, 3, ~0U, 0);
+#endif
+        execl(pool->path, pool->path, (char *)NULL);
+        fprintf(stderr, "Unable to exec %s: %s\n", pool->path, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    __atomic_store_n(&pool->workers[i].requests, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&pool->workers[i].retiring, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&pool->workers[i].pid, pid, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Find worker with process id.
+ *
+ * Returns true and sets pool and index if found, false otherwise.
+ **/
+static bool
+fastcgi_find(pid_t pid, struct fastcgi_pool **pool, size_t *index)
+{
+    for (size_t p = 0; p < PoolsCount; p++) {
+        for (size_t i = 0; i < Pools[p].size; i++) {
+            if (Pools[p].workers[i].pid == pid) {
+                *pool  = &Pools[p];
+                *index = i;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Stop manager (signal handler).
+ **/
+static void
+fastcgi_stop(int signum)
+{
+    Stopping = 1;
+}
+
+/**
+ * Manager process: keep every pool's workers running.
+ *
+ * Workers that exit are respawned.  Workers that reached max_requests are
+ * marked as retiring (so no new requests are dispatched to them) and are
+ * terminated and respawned once idle.  Since the listening sockets belong to
+ * the manager, connections made while a worker restarts simply wait in the
+ * socket's backlog.
+ **/
+static void
+fastcgi_manager(void)
+{
+    struct timespec tick = {0, FASTCGI_TICK};
+    struct fastcgi_pool *pool;
+    size_t index;
+    pid_t  pid;
+    int    status;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGTERM, fastcgi_stop);
+    signal(SIGINT, fastcgi_stop);
+    signal(SIGCHLD, SIG_DFL);
+
+    for (size_t p = 0; p < PoolsCount; p++) {
+        for (size_t i = 0; i < Pools[p].size; i++) {
+            fastcgi_spawn(&Pools[p], i);
+        }
+    }
+
+    while (!Stopping) {
+        /* Respawn workers that exited */
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (!fastcgi_find(pid, &pool, &index)) {
+                continue;
+            }
+            if (__atomic_load_n(&pool->workers[index].retiring, __ATOMIC_SEQ_CST)) {
+                __atomic_add_fetch(pool->recycles, 1, __ATOMIC_RELAXED);
+            } else {
+                log("FastCGI worker %d for %s exited (status %d), respawning", pid, pool->key, status);
+                __atomic_add_fetch(pool->respawns, 1, __ATOMIC_RELAXED);
+            }
+            pool->workers[index].pid = 0;
+            fastcgi_spawn(pool, index);
+        }
+
+        /* Recycle idle workers that served max_requests */
+        for (size_t p = 0; p < PoolsCount; p++) {
+            pool = &Pools[p];
+            for (size_t i = 0; i < pool->size && pool->max_requests; i++) {
+                struct fastcgi_worker *w = &pool->workers[i];
+
+                if (w->pid <= 0) {
+                    continue;
+                }
+                if (!__atomic_load_n(&w->retiring, __ATOMIC_SEQ_CST) &&
+                    __atomic_load_n(&w->requests, __ATOMIC_SEQ_CST) >= pool->max_requests) {
+                    __atomic_store_n(&w->retiring, true, __ATOMIC_SEQ_CST);
+                }
+                if (__atomic_load_n(&w->retiring, __ATOMIC_SEQ_CST) &&
+                    __atomic_load_n(&w->inflight, __ATOMIC_SEQ_CST) == 0) {
+                    kill(w->pid, SIGTERM);
+                }
+            }
+        }
+
+        nanosleep(&tick, NULL);
+    }
+
+    /* Terminate workers and remove sockets */
+    for (size_t p = 0; p < PoolsCount; p++) {
+        for (size_t i = 0; i < Pools[p].size; i++) {
+            if (Pools[p].workers[i].pid > 0) {
+                kill(Pools[p].workers[i].pid, SIGTERM);
+            }
+            unlink(Pools[p].address[i].sun_path);
+        }
+    }
+    rmdir(SocketDirectory);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Choose worker for request and count it as in flight.
+ *
+ * Idle workers are preferred (starting from a round-robin position);
+ * otherwise the least busy worker is used and the request waits in its
+ * socket's backlog.  Retiring workers are skipped.
+ *
+ * Returns worker index.
+ **/
+static size_t
+fastcgi_dispatch(struct fastcgi_pool *pool)
+{
+    while (true) {
+        size_t start = __atomic_fetch_add(pool->next, 1, __ATOMIC_RELAXED);
+        size_t best  = start % pool->size;
+        size_t least = SIZE_MAX;
+
+        for (size_t n = 0; n < pool->size; n++) {
+            size_t i = (start + n) % pool->size;
+            size_t inflight;
+
+            if (__atomic_load_n(&pool->workers[i].retiring, __ATOMIC_SEQ_CST)) {
+                continue;
+            }
+            if ((inflight = __atomic_load_n(&pool->workers[i].inflight, __ATOMIC_RELAXED)) < least) {
+                least = inflight;
+                best  = i;
+            }
+            if (inflight == 0) {
+                break;
+            }
+        }
+
+        /* Claim worker, unless it started retiring in the meantime (the
+         * manager sets retiring before checking inflight, so one of us sees
+         * the other) */
+        __atomic_add_fetch(&pool->workers[best].inflight, 1, __ATOMIC_SEQ_CST);
+        if (least == SIZE_MAX || !__atomic_load_n(&pool->workers[best].retiring, __ATOMIC_SEQ_CST)) {
+            return best;
+        }
+        __atomic_sub_fetch(&pool->workers[best].inflight, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Write FastCGI record to worker connection.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+fastcgi_record(struct conn *w, int type, const void *data, size_t n)
+{
+    struct fcgi_header header = {
+        .version        = FCGI_VERSION_1,
+        .type           = type,
+        .request_id     = {0, FCGI_REQUEST_ID},
+        .content_length = {(n >> 8) & 0xff, n & 0xff},
+    };
+
+    if (conn_write(w, &header, sizeof(header)) < 0) {
+        return -1;
+    }
+    return n ? conn_write(w, data, n) : 0;
+}
+
+/**
+ * Write stream (e.g. FCGI_PARAMS or FCGI_STDIN) contents to worker
+ * connection as records of at most FASTCGI_RECORD_MAX bytes.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+fastcgi_stream(struct conn *w, int type, const char *data, size_t n)
+{
+    while (n > 0) {
+        size_t length = n < FASTCGI_RECORD_MAX ? n : FASTCGI_RECORD_MAX;
+        if (fastcgi_record(w, type, data, length) < 0) {
+            return -1;
+        }
+        data += length;
+        n    -= length;
+    }
+    return 0;
+}
+
+/**
+ * Encode CGI environment as FastCGI name-value pairs.
+ *
+ * Returns newly allocated pairs (and sets length) on success, NULL on error.
+ **/
+static char *
+fastcgi_params(char **envp, size_t *length)
+{
+    size_t size = 0;
+    unsigned char *params;
+    unsigned char *p;
+
+    for (char **e = envp; *e; e++) {
+        size += strlen(*e) + 8;
+    }
+    if ((p = params = malloc(size)) == NULL) {
+        return NULL;
+    }
+
+    for (char **e = envp; *e; e++) {
+        const char *value = strchr(*e, '=') + 1;
+        size_t nlength = value - 1 - *e;
+        size_t vlength = strlen(value);
+        size_t lengths[2] = {nlength, vlength};
+
+        for (int l = 0; l < 2; l++) {
+            if (lengths[l] < 128) {
+                *p++ = lengths[l];
+            } else {
+                *p++ = ((lengths[l] >> 24) & 0x7f) | 0x80;
+                *p++ = (lengths[l] >> 16) & 0xff;
+                *p++ = (lengths[l] >> 8) & 0xff;
+                *p++ = lengths[l] & 0xff;
+            }
+        }
+        memcpy(p, *e, nlength);
+        p += nlength;
+        memcpy(p, value, vlength);
+        p += vlength;
+    }
+
+    *length = p - params;
+    return (char *)params;
+}
+
+/**
+ * Read exactly n bytes from worker connection.
+ *
+ * Returns 0 on success, -1 on error or end of file.
+ **/
+static int
+fastcgi_read(struct conn *w, void *data, size_t n)
+{
+    for (size_t total = 0; total < n; ) {
+        ssize_t nread = conn_read(w, (char *)data + total, n - total);
+        if (nread <= 0) {
+            return -1;
+        }
+        total += nread;
+    }
+    return 0;
+}
+
+/**
+ * Send request (parameters and body) to worker.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+fastcgi_send_request(struct conn *w, struct request *r)
+{
+    unsigned char begin[8] = {0, FCGI_RESPONDER, 0};
+    size_t remaining;
+    char **envp;
+    char  *params;
+    size_t length;
+    int    status;
+
+    if (request_content_length(r, &remaining) < 0 || (envp = cgi_environment(r)) == NULL) {
+        return -1;
+    }
+    params = fastcgi_params(envp, &length);
+    free(envp);
+    if (params == NULL) {
+        return -1;
+    }
+
+    status = fastcgi_record(w, FCGI_BEGIN_REQUEST, begin, sizeof(begin)) < 0 ||
+             fastcgi_stream(w, FCGI_PARAMS, params, length) < 0 ||
+             fastcgi_record(w, FCGI_PARAMS, NULL, 0) < 0 ? -1 : 0;
+    free(params);
+
+    /* Forward request body (from the read-ahead buffer, then the socket) */
+    while (status == 0 && remaining > 0) {
+        char buffer[CONN_BUFSIZ];
+        ssize_t nread = conn_read(&r->conn, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+        if (nread <= 0) {
+            status = -1;
+            break;
+        }
+        status = fastcgi_stream(w, FCGI_STDIN, buffer, nread);
+        remaining -= nread;
+    }
+
+    if (status < 0 || fastcgi_record(w, FCGI_STDIN, NULL, 0) < 0) {
+        return -1;
+    }
+    return conn_flush(w);
+}
+
+/**
+ * Write CGI header block from worker as HTTP response head: the Status
+ * header becomes the status line (Location without Status means 302 Found).
+ **/
+static void
+fastcgi_write_head(struct request *r, const char *head, size_t n)
+{
+    const char *blank = head + n - (n >= 2 && head[n - 2] == '\r' ? 2 : 1);
+    const char *status;
+    size_t length;
+
+    if ((status = cgi_head_value(head, n, "Status", &length))) {
+        conn_printf(&r->conn, "HTTP/1.0 %.*s\r\n", (int)length, status);
+    } else if (cgi_head_value(head, n, "Location", &length)) {
+        conn_printf(&r->conn, "HTTP/1.0 302 Found\r\n");
+    } else {
+        conn_printf(&r->conn, "HTTP/1.0 200 OK\r\n");
+    }
+
+    for (const char *line = head, *end; line < blank; line = end + 1) {
+        end = memchr(line, '\n', blank - line);
+        if (strncasecmp(line, "Status:", 7) != 0) {
+            conn_write(&r->conn, line, end + 1 - line);
+        }
+    }
+    conn_printf(&r->conn, "\r\n");
+}
+
+/**
+ * Relay worker's response records to the client until the end of the
+ * request.
+ *
+ * Returns 0 on success, -1 if the worker failed before sending a response
+ * head.
+ **/
+static int
+fastcgi_relay_response(struct conn *w, struct request *r)
+{
+    char   head[BUFSIZ];
+    size_t hlength = 0;
+    size_t hsize   = 0;         /* Header block length, once complete */
+    char   content[FASTCGI_RECORD_MAX + 255];
+
+    while (true) {
+        struct fcgi_header header;
+        size_t length;
+
+        if (fastcgi_read(w, &header, sizeof(header)) < 0) {
+            break;
+        }
+        length = (header.content_length[0] << 8) | header.content_length[1];
+        if (fastcgi_read(w, content, length + header.padding_length) < 0) {
+            break;
+        }
+
+        if (header.type == FCGI_END_REQUEST) {
+            break;
+        } else if (header.type == FCGI_STDERR) {
+            fprintf(stderr, "%.*s", (int)length, content);
+        } else if (header.type == FCGI_STDOUT && hsize) {
+            conn_write(&r->conn, content, length);
+        } else if (header.type == FCGI_STDOUT) {
+            /* Accumulate header block, then send it along with the start of
+             * the body */
+            size_t n = length < sizeof(head) - hlength ? length : sizeof(head) - hlength;
+            memcpy(head + hlength, content, n);
+            hlength += n;
+            if ((hsize = cgi_head_length(head, hlength)) == 0) {
+                if (hlength == sizeof(head)) {
+                    break;
+                }
+                continue;
+            }
+            fastcgi_write_head(r, head, hsize);
+            conn_write(&r->conn, head + hsize, hlength - hsize);
+            conn_write(&r->conn, content + n, length - n);
+        }
+    }
+
+    return hsize ? 0 : -1;
+}
+
+/* Functions */
+
+/**
+ * Configure FastCGI pool from specification "uri:workers[:max_requests]"
+ * (e.g. "/scripts/app.fcgi:4:1000").
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+fastcgi_configure(const char *spec)
+{
+    struct fastcgi_pool *pool = &Pools[PoolsCount];
+    char   uri[PATH_MAX];
+    char   key[PATH_MAX];
+    char  *colon;
+    char  *requests;
+
+    if (PoolsCount == FASTCGI_POOLS_MAX) {
+        fprintf(stderr, "Too many FastCGI pools\n");
+        return -1;
+    }
+
+    snprintf(uri, sizeof(uri), "%s", spec);
+    if ((colon = strchr(uri, ':')) == NULL) {
+        return -1;
+    }
+    *colon++ = '\0';
+
+    /* Both numbers must be plain decimal (as for every other option) */
+    if ((requests = strchr(colon, ':')) != NULL) {
+        *requests++ = '\0';
+    }
+    pool->max_requests = 0;
+    if (parse_number(colon, &pool->size) < 0 || (requests && parse_number(requests, &pool->max_requests) < 0)) {
+        return -1;
+    }
+    if (pool->size == 0 || pool->size > FASTCGI_WORKERS_MAX || normalize_uri(uri, key, sizeof(key)) < 0) {
+        return -1;
+    }
+    if ((pool->key = strdup(key)) == NULL) {
+        return -1;
+    }
+
+    PoolsCount++;
+    return 0;
+}
+
+/**
+ * Start FastCGI pools: create each worker's listening socket and fork the
+ * manager process that spawns and supervises the workers.
+ *
+ * Must be called after RootPath is resolved and before any server process or
+ * thread is started.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+fastcgi_start(void)
+{
+    struct fastcgi_worker *workers;
+    size_t *counters;
+    size_t  nworkers = 0;
+    pid_t   pid;
+
+    if (PoolsCount == 0) {
+        return 0;
+    }
+
+    if (mkdtemp(SocketDirectory) == NULL) {
+        fprintf(stderr, "Unable to create FastCGI socket directory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Allocate worker state in memory shared by all server processes */
+    for (size_t p = 0; p < PoolsCount; p++) {
+        nworkers += Pools[p].size;
+    }
+    workers  = mmap(NULL, nworkers * sizeof(struct fastcgi_worker) + PoolsCount * 3 * sizeof(size_t),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED) {
+        fprintf(stderr, "Unable to map FastCGI state: %s\n", strerror(errno));
+        return -1;
+    }
+    counters = (size_t *)(workers + nworkers);
+
+    for (size_t p = 0; p < PoolsCount; p++) {
+        struct fastcgi_pool *pool = &Pools[p];
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/%s", RootPath, pool->key);
+        if ((pool->path = strdup(path)) == NULL) {
+            return -1;
+        }
+        pool->workers  = workers;
+        pool->next     = counters++;
+        pool->respawns = counters++;
+        pool->recycles = counters++;
+        workers += pool->size;
+
+        for (size_t i = 0; i < pool->size; i++) {
+            struct sockaddr_un *address = &pool->address[i];
+
+            address->sun_family = AF_UNIX;
+            snprintf(address->sun_path, sizeof(address->sun_path), "%s/%zu.%zu", SocketDirectory, p, i);
+            if ((pool->listen[i] = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+                bind(pool->listen[i], (struct sockaddr *)address, sizeof(*address)) < 0 ||
+                listen(pool->listen[i], FASTCGI_BACKLOG) < 0) {
+                fprintf(stderr, "Unable to listen on %s: %s\n", address->sun_path, strerror(errno));
+                return -1;
+            }
+        }
+        debug("FastCGI pool %s: %zu workers, max requests %zu", pool->path, pool->size, pool->max_requests);
+    }
+
+    /* Fork manager (the listening sockets are only needed there) */
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Unable to fork FastCGI manager: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        fastcgi_manager();
+    }
+    for (size_t p = 0; p < PoolsCount; p++) {
+        for (size_t i = 0; i < Pools[p].size; i++) {
+            close(Pools[p].listen[i]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Lookup FastCGI pool for script (path relative to RootPath).
+ *
+ * Returns pool, or NULL if the script is not served by a pool.
+ **/
+struct fastcgi_pool *
+fastcgi_lookup(const char *relative)
+{
+    for (size_t p = 0; p < PoolsCount; p++) {
+        if (streq(Pools[p].key, relative)) {
+            return &Pools[p];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Handle request with a worker of FastCGI pool
+ *
+ * The request is sent to a worker over its Unix socket as FastCGI records
+ * (the CGI environment as FCGI_PARAMS and any request body as FCGI_STDIN),
+ * and the worker's FCGI_STDOUT is relayed to the client, with its CGI header
+ * block turned into an HTTP response head.
+ *
+ * If the Content-Length is malformed, then handle error with
+ * HTTP_STATUS_BAD_REQUEST.  If no worker can be reached or it fails before
+ * responding, then handle error with HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+http_status
+fastcgi_handle(struct fastcgi_pool *pool, struct request *r)
+{
+    struct fastcgi_worker *worker;
+    struct conn *w;
+    size_t index;
+    size_t body;
+    int    fd;
+    int    status = -1;
+
+    if (request_content_length(r, &body) < 0) {
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    }
+
+    index  = fastcgi_dispatch(pool);
+    worker = &pool->workers[index];
+    if ((w = malloc(sizeof(struct conn))) == NULL) {
+        __atomic_sub_fetch(&worker->inflight, 1, __ATOMIC_SEQ_CST);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0 &&
+        connect(fd, (struct sockaddr *)&pool->address[index], sizeof(pool->address[index])) == 0) {
+        conn_init(w, fd);
+        if (fastcgi_send_request(w, r) == 0) {
+            status = fastcgi_relay_response(w, r);
+        }
+    } else {
+        debug("Unable to connect to %s: %s", pool->address[index].sun_path, strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(w);
+
+    __atomic_add_fetch(&worker->requests, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&worker->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (status < 0) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    conn_flush(&r->conn);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Write FastCGI pool statistics to connection as plain text.
+ **/
+void
+fastcgi_write_status(struct conn *c)
+{
+    for (size_t p = 0; p < PoolsCount; p++) {
+        struct fastcgi_pool *pool = &Pools[p];
+        size_t inflight = 0;
+        size_t requests = 0;
+
+        for (size_t i = 0; i < pool->size; i++) {
+            inflight += __atomic_load_n(&pool->workers[i].inflight, __ATOMIC_RELAXED);
+            requests += __atomic_load_n(&pool->workers[i].requests, __ATOMIC_RELAXED);
+        }
+        conn_printf(c, "fastcgi.%s.workers %zu\n", pool->key, pool->size);
+        conn_printf(c, "fastcgi.%s.inflight %zu\n", pool->key, inflight);
+        conn_printf(c, "fastcgi.%s.requests %zu\n", pool->key, requests);
+        conn_printf(c, "fastcgi.%s.respawns %zu\n", pool->key, __atomic_load_n(pool->respawns, __ATOMIC_RELAXED));
+        conn_printf(c, "fastcgi.%s.recycles %zu\n", pool->key, __atomic_load_n(pool->recycles, __ATOMIC_RELAXED));
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,587 @@
+/* fdcache.c: Open File Descriptor Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FDCACHE_BUCKETS	    1024		/* Hash table buckets */
+#define FDCACHE_WATCHES	    4096		/* Maximum watched directories */
+#define FDCACHE_MISSING_SHARE 8			/* Negative entries are 1/8 of size */
+#define FDCACHE_EVENTS	    (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Internal Structures */
+
+struct fdcache_watch {
+    int   wd;		/* Inotify watch descriptor */
+    char *directory;	/* Watched directory (relative to RootPath) */
+};
+
+/* Internal Variables */
+
+static struct fd_entry	     *Buckets[FDCACHE_BUCKETS];
+static struct fd_entry	      Recent = {.lru_next = &Recent, .lru_prev = &Recent};
+static struct fd_entry	      Missing = {.lru_next = &Missing, .lru_prev = &Missing};
+static struct fdcache_watch   Watches[FDCACHE_WATCHES];
+static size_t		      WatchesCount = 0;
+static size_t		      Entries = 0;
+static size_t		      MissingEntries = 0;
+static size_t		      Generation = 0;	/* Bumped by every invalidation */
+static size_t		      Hits = 0;
+static size_t		      Misses = 0;
+static size_t		      Invalidations = 0;
+static int		      InotifyFd = -1;
+static pthread_mutex_t	      Lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Internal Functions */
+
+/**
+ * Hash key (FNV-1a).
+ **/
+static size_t
+fdcache_hash(const char *key)
+{
+    size_t hash = 2166136261u;
+
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Close and free entry.
+ **/
+static void
+fdcache_free(struct fd_entry *e)
+{
+    if (e->fd >= 0) {
+        close(e->fd);
+    }
+    free(e->type);
+    free(e->key);
+    free(e);
+}
+
+/**
+ * Move entry to the front of its recently used list: Missing for negative
+ * entries, Recent for open descriptors (must hold Lock).
+ **/
+static void
+fdcache_touch(struct fd_entry *e)
+{
+    struct fd_entry *list = e->fd < 0 ? &Missing : &Recent;
+
+    if (e->lru_next) {
+        e->lru_prev->lru_next = e->lru_next;
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    e->lru_next = list->lru_next;
+    e->lru_prev = list;
+    list->lru_next->lru_prev = e;
+    list->lru_next = e;
+}
+
+/**
+ * Remove entry from hash table and LRU list, and drop the cache's reference
+ * (must hold Lock).
+ **/
+static void
+fdcache_remove(struct fd_entry *e)
+{
+    struct fd_entry **p = &Buckets[e->hash % FDCACHE_BUCKETS];
+
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    e->cached = false;
+    if (e->fd < 0) {
+        MissingEntries--;
+    } else {
+        Entries--;
+    }
+
+    if (--e->refs == 0) {
+        fdcache_free(e);
+    }
+}
+
+/**
+ * Invalidate entry for key, along with every entry below it if it is a
+ * directory, or every entry if key is NULL (must hold Lock).
+ **/
+static void
+fdcache_invalidate(const char *key)
+{
+    size_t length = key ? strlen(key) : 0;
+
+    Generation++;
+    for (size_t b = 0; b < FDCACHE_BUCKETS; b++) {
+        struct fd_entry *e = Buckets[b];
+        while (e) {
+            struct fd_entry *next = e->next;
+            if (key == NULL || (strncmp(e->key, key, length) == 0 && (e->key[length] == '\0' || e->key[length] == '/'))) {
+                fdcache_remove(e);
+                Invalidations++;
+            }
+            e = next;
+        }
+    }
+}
+
+/**
+ * Watch directory (relative to RootPath) for changes, unless it is already
+ * being watched (must hold Lock).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+fdcache_watch(const char *directory)
+{
+    char path[PATH_MAX];
+    int  wd;
+
+    for (size_t i = 0; i < WatchesCount; i++) {
+        if (streq(Watches[i].directory, directory)) {
+            return 0;
+        }
+    }
+    if (WatchesCount == FDCACHE_WATCHES) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", RootPath, directory);
+    if ((wd = inotify_add_watch(InotifyFd, path, FDCACHE_EVENTS)) < 0) {
+        debug("Unable to watch %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < WatchesCount; i++) {
+        if (Watches[i].wd == wd) {      /* Same directory under another name */
+            return -1;                  /* (its events name the other one) */
+        }
+    }
+    if ((Watches[WatchesCount].directory = strdup(directory)) == NULL) {
+        inotify_rm_watch(InotifyFd, wd);
+        return -1;
+    }
+    Watches[WatchesCount++].wd = wd;
+    return 0;
+}
+
+/**
+ * Watch directory (relative to RootPath) and each of its ancestors up to
+ * RootPath, so that renaming any of them is noticed (must hold Lock).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+fdcache_watch_path(const char *directory)
+{
+    char prefix[PATH_MAX];
+    int  status;
+
+    if (fdcache_watch(".") < 0) {
+        return -1;
+    }
+    if (streq(directory, ".")) {
+        return 0;
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s", directory);
+    for (char *slash = strchr(prefix, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        status = fdcache_watch(prefix);
+        *slash = '/';
+        if (status < 0) {
+            return -1;
+        }
+    }
+    return fdcache_watch(prefix);
+}
+
+/**
+ * Remove watches for directory (relative to RootPath) and every directory
+ * below it, since they no longer refer to what is at those paths; the next
+ * open watches them again (must hold Lock).
+ **/
+static void
+fdcache_unwatch_below(const char *directory)
+{
+    size_t length = strlen(directory);
+    bool   all = streq(directory, ".");
+
+    for (size_t i = 0; i < WatchesCount; ) {
+        const char *watched = Watches[i].directory;
+        if (all || (strncmp(watched, directory, length) == 0 && (watched[length] == '\0' || watched[length] == '/'))) {
+            inotify_rm_watch(InotifyFd, Watches[i].wd);
+            free(Watches[i].directory);
+            Watches[i] = Watches[--WatchesCount];
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Forget watch descriptor removed by the kernel (must hold Lock).
+ **/
+static void
+fdcache_unwatch(int wd)
+{
+    for (size_t i = 0; i < WatchesCount; i++) {
+        if (Watches[i].wd == wd) {
+            free(Watches[i].directory);
+            Watches[i] = Watches[--WatchesCount];
+            return;
+        }
+    }
+}
+
+/**
+ * Handle one inotify event (must hold Lock).
+ *
+ * A change to an entry inside a watched directory invalidates that entry
+ * (and everything below it).  Creating, deleting, or renaming an entry also
+ * changes the directory itself, so the directory's entry is invalidated too.
+ *
+ * Watches follow inodes rather than names, so once a watched directory is
+ * moved or deleted (or another one takes its name), the watches for it and
+ * everything below it are removed, to be added again by the next open.
+ **/
+static void
+fdcache_event(const struct inotify_event *event)
+{
+    char key[PATH_MAX];
+    char directory[PATH_MAX] = "";
+    int  length;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        fdcache_invalidate(NULL);
+        return;
+    }
+
+    for (size_t i = 0; i < WatchesCount; i++) {
+        if (Watches[i].wd == event->wd) {
+            snprintf(directory, sizeof(directory), "%s", Watches[i].directory);
+            break;
+        }
+    }
+    if (directory[0] == '\0') {
+        return;
+    }
+
+    if (event->len > 0) {
+        if (streq(directory, ".")) {
+            length = snprintf(key, sizeof(key), "%s", event->name);
+        } else {
+            length = snprintf(key, sizeof(key), "%s/%s", directory, event->name);
+        }
+        if (length >= (int)sizeof(key)) {   /* Cannot name it: drop everything */
+            fdcache_invalidate(NULL);
+            fdcache_unwatch_below(".");
+            return;
+        }
+        fdcache_invalidate(key);
+        if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+            fdcache_unwatch_below(key);
+        }
+    }
+    if (event->len == 0 || (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        fdcache_invalidate(directory);
+    }
+    if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+        fdcache_invalidate(streq(directory, ".") ? NULL : directory);
+        fdcache_unwatch_below(directory);
+    }
+
+    if (event->mask & IN_IGNORED) {
+        fdcache_unwatch(event->wd);
+    }
+}
+
+/**
+ * Invalidation thread: apply inotify events to the cache as they arrive.
+ **/
+static void *
+fdcache_thread(void *arg)
+{
+    char buffer[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread;
+
+    while ((nread = read(InotifyFd, buffer, sizeof(buffer))) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Unable to read inotify events: %s\n", strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&Lock);
+        for (char *p = buffer; p < buffer + nread; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            fdcache_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        pthread_mutex_unlock(&Lock);
+    }
+
+    /* Without invalidation, stop caching */
+    pthread_mutex_lock(&Lock);
+    FdCacheSize = 0;
+    fdcache_invalidate(NULL);
+    pthread_mutex_unlock(&Lock);
+    return NULL;
+}
+
+/* Functions */
+
+/**
+ * Start inotify watcher for RootPath.
+ *
+ * If inotify is not available, the descriptor cache is disabled, since
+ * entries could not be invalidated.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+fdcache_start(void)
+{
+    pthread_t thread;
+    int status;
+
+    if (FdCacheSize == 0) {
+        return 0;
+    }
+
+    if ((InotifyFd = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "Unable to initialize inotify: %s\n", strerror(errno));
+        FdCacheSize = 0;
+        return -1;
+    }
+    if ((status = pthread_create(&thread, NULL, fdcache_thread, NULL)) != 0) {
+        fprintf(stderr, "Unable to start inotify watcher: %s\n", strerror(status));
+        close(InotifyFd);
+        FdCacheSize = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Open normalized path (relative to RootPath) through the descriptor cache.
+ *
+ * On a hit, the cached descriptor and its status are shared: no syscalls are
+ * made.  Readers must use offset-based I/O (pread, sendfile with an offset)
+ * and never change the descriptor's file position.  On a miss, the path is
+ * opened with open_beneath, its status taken, and the entry is cached once
+ * its containing directory and each of that directory's ancestors are
+ * watched for changes.  Paths that do not exist
+ * are cached as well (as negative entries), so repeated probes for them
+ * (e.g. for optional sibling files) make no syscalls either.  Negative
+ * entries are kept in a separate list capped at a small share of
+ * FdCacheSize, so they never evict open descriptors.
+ *
+ * Returns entry (with a reference taken) on success, NULL on error (with
+ * errno set).  The entry must be released with fdcache_release.
+ **/
+struct fd_entry *
+fdcache_open(const char *relative)
+{
+    struct fd_entry *e;
+    size_t hash = fdcache_hash(relative);
+    size_t generation;
+    char   directory[PATH_MAX];
+    char  *slash;
+
+    /* Lookup cached entry */
+    pthread_mutex_lock(&Lock);
+    for (e = Buckets[hash % FDCACHE_BUCKETS]; e; e = e->next) {
+        if (e->hash == hash && streq(e->key, relative)) {
+            fdcache_touch(e);
+            Hits++;
+            if (e->fd < 0) {            /* Known not to exist */
+                errno = e->error;
+                e = NULL;
+            } else {
+                e->refs++;
+            }
+            pthread_mutex_unlock(&Lock);
+            return e;
+        }
+    }
+    Misses++;
+
+    /* Watch containing directory (and directories themselves) before
+     * opening, so no change after the open can be missed */
+    bool cacheable = FdCacheSize > 0;
+    if (cacheable) {
+        snprintf(directory, sizeof(directory), "%s", relative);
+        if ((slash = strrchr(directory, '/')) != NULL) {
+            *slash = '\0';
+        } else if (!streq(directory, ".")) {
+            strcpy(directory, ".");
+        }
+        cacheable = fdcache_watch_path(directory) == 0;
+    }
+    generation = Generation;
+    pthread_mutex_unlock(&Lock);
+
+    /* Open and stat path (remembering paths that do not exist) */
+    if ((e = calloc(1, sizeof(struct fd_entry))) == NULL) {
+        return NULL;
+    }
+    e->refs = 1;
+    e->hash = hash;
+    if ((e->key = strdup(relative)) == NULL) {
+        e->fd = -1;
+        fdcache_free(e);
+        return NULL;
+    }
+    if ((e->fd = open_beneath(relative)) < 0) {
+        e->error = errno;
+        cacheable = cacheable && (e->error == ENOENT || e->error == ENOTDIR);
+    } else if (fstat(e->fd, &e->st) < 0) {
+        e->error = errno;
+        close(e->fd);
+        e->fd = -1;
+        cacheable = false;
+    }
+
+    if (!cacheable) {
+        if (e->fd < 0) {
+            int error = e->error;
+            fdcache_free(e);
+            errno = error;
+            return NULL;
+        }
+        return e;
+    }
+
+    pthread_mutex_lock(&Lock);
+    if (e->fd >= 0 && S_ISDIR(e->st.st_mode) && fdcache_watch(relative) < 0) {
+        cacheable = false;
+    }
+
+    /* Only cache if nothing was invalidated since the open (the entry may
+     * already be stale) and no other request cached it in the meantime */
+    if (cacheable && Generation == generation) {
+        struct fd_entry *other;
+        for (other = Buckets[hash % FDCACHE_BUCKETS]; other; other = other->next) {
+            if (other->hash == hash && streq(other->key, relative)) {
+                break;
+            }
+        }
+
+        if (other == NULL) {
+            /* Evict least recently used entry of the same kind, so probes
+             * for missing paths cannot push out open descriptors */
+            if (e->fd < 0) {
+                if (MissingEntries >= FdCacheSize / FDCACHE_MISSING_SHARE + 1) {
+                    fdcache_remove(Missing.lru_prev);
+                }
+                MissingEntries++;
+            } else {
+                if (Entries >= FdCacheSize) {
+                    fdcache_remove(Recent.lru_prev);
+                }
+                Entries++;
+            }
+
+            e->refs++;
+            e->cached = true;
+            e->next = Buckets[hash % FDCACHE_BUCKETS];
+            Buckets[hash % FDCACHE_BUCKETS] = e;
+            fdcache_touch(e);
+        }
+    }
+    if (e->fd < 0) {
+        int error = e->error;
+        if (--e->refs == 0) {
+            fdcache_free(e);
+        }
+        errno = error;
+        e = NULL;
+    }
+    pthread_mutex_unlock(&Lock);
+    return e;
+}
+
+/**
+ * Release reference to entry taken by fdcache_open (closing the descriptor
+ * once it is no longer cached or used).
+ **/
+void
+fdcache_release(struct fd_entry *e)
+{
+    if (e == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&Lock);
+    if (--e->refs == 0) {
+        fdcache_free(e);
+    }
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Return mimetype of entry's file (with the specified path), determining it
+ * on first use.
+ *
+ * The mimetype is kept with the entry, so for a cached entry the mime.types
+ * file is only consulted once.  Returns NULL if it cannot be determined.
+ **/
+const char *
+fdcache_mimetype(struct fd_entry *e, const char *path)
+{
+    char *type = __atomic_load_n(&e->type, __ATOMIC_ACQUIRE);
+    char *expected = NULL;
+
+    if (type) {
+        return type;
+    }
+    if ((type = determine_mimetype(path)) == NULL) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&e->type, &expected, type, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(type);             /* Another request got there first */
+        type = expected;
+    }
+    return type;
+}
+
+/**
+ * Write descriptor cache statistics to connection as plain text.
+ **/
+void
+fdcache_write_status(struct conn *c)
+{
+    pthread_mutex_lock(&Lock);
+    size_t entries = Entries, missing = MissingEntries, hits = Hits, misses = Misses, invalidations = Invalidations, watches = WatchesCount;
+    pthread_mutex_unlock(&Lock);
+
+    conn_printf(c, "fdcache.entries %zu\n", entries);
+    conn_printf(c, "fdcache.missing %zu\n", missing);
+    conn_printf(c, "fdcache.watches %zu\n", watches);
+    conn_printf(c, "fdcache.hits %zu\n", hits);
+    conn_printf(c, "fdcache.misses %zu\n", misses);
+    conn_printf(c, "fdcache.invalidations %zu\n", invalidations);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
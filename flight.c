@@ -0,0 +1,211 @@
+/* flight.c: Request Coalescing (Single-Flight) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+#define FLIGHT_BUCKETS	    256			/* Hash table buckets */
+#define FLIGHT_WAIT	    5			/* Seconds followers wait for leader */
+
+/* Internal Structures */
+
+struct flight {
+    char	  *key;			/* Key of work in progress */
+    size_t	   hash;		/* Hash of key */
+    bool	   done;		/* Leader finished */
+    size_t	   refs;		/* Leader and followers */
+    size_t	   followers;		/* Requests waiting for the result */
+    char	  *data;		/* Result shared with followers (may be NULL) */
+    size_t	   length;		/* Length of result */
+    struct flight *next;		/* Hash chain */
+};
+
+/* Internal Variables */
+
+static struct flight  *Buckets[FLIGHT_BUCKETS];
+static size_t	       Leaders = 0;
+static size_t	       Followers = 0;
+static size_t	       Timeouts = 0;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  Done = PTHREAD_COND_INITIALIZER;
+
+/* Internal Functions */
+
+/**
+ * Hash key (FNV-1a).
+ **/
+static size_t
+flight_hash(const char *key)
+{
+    size_t hash = 2166136261u;
+
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Drop reference to flight, freeing it with the last one (must hold Lock).
+ **/
+static void
+flight_put(struct flight *f)
+{
+    if (--f->refs == 0) {
+        free(f->data);
+        free(f->key);
+        free(f);
+    }
+}
+
+/* Functions */
+
+/**
+ * Join flight for key (e.g. a cache key).
+ *
+ * If no request is doing the work for key yet, a flight is started and the
+ * caller becomes its leader: it must do the work and then call flight_finish.
+ * Otherwise, the caller follows the flight in progress: this blocks until the
+ * leader finishes, after which the result can be picked up from where the
+ * leader stored it (e.g. the cache) or with flight_result, and the caller must
+ * call flight_release.  A follower waits at most FLIGHT_WAIT seconds, so a
+ * slow leader (e.g. one relaying to a slow client) cannot stall the others.
+ *
+ * Returns flight (and sets leader), or NULL if no flight could be started or
+ * the leader did not finish in time (the caller should then do the work on
+ * its own).
+ **/
+struct flight *
+flight_join(const char *key, bool *leader)
+{
+    size_t hash = flight_hash(key);
+    struct flight *f;
+
+    pthread_mutex_lock(&Lock);
+    for (f = Buckets[hash % FLIGHT_BUCKETS]; f; f = f->next) {
+        if (f->hash == hash && streq(f->key, key)) {
+            break;
+        }
+    }
+
+    if (f) {
+        /* Follow flight in progress (for a while) */
+        struct timespec deadline;
+        int status = 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLIGHT_WAIT;
+
+        f->refs++;
+        f->followers++;
+        Followers++;
+        while (!f->done && status != ETIMEDOUT) {
+            status = pthread_cond_timedwait(&Done, &Lock, &deadline);
+        }
+        if (!f->done) {
+            f->followers--;
+            Timeouts++;
+            flight_put(f);
+            f = NULL;
+        }
+        *leader = false;
+    } else if ((f = calloc(1, sizeof(struct flight))) && (f->key = strdup(key))) {
+        /* Lead new flight */
+        f->hash = hash;
+        f->refs = 1;
+        f->next = Buckets[hash % FLIGHT_BUCKETS];
+        Buckets[hash % FLIGHT_BUCKETS] = f;
+        Leaders++;
+        *leader = true;
+    } else {
+        free(f);
+        f = NULL;
+    }
+    pthread_mutex_unlock(&Lock);
+    return f;
+}
+
+/**
+ * Finish flight as its leader, waking its followers.
+ *
+ * The result to share with the followers (which must have been malloc'd and
+ * is owned by the flight from now on) may be NULL, e.g. if the leader stored
+ * it elsewhere or failed, in which case followers do the work themselves.
+ **/
+void
+flight_finish(struct flight *f, char *data, size_t length)
+{
+    struct flight **p;
+
+    if (f == NULL) {
+        free(data);
+        return;
+    }
+
+    pthread_mutex_lock(&Lock);
+    for (p = &Buckets[f->hash % FLIGHT_BUCKETS]; *p != f; p = &(*p)->next);
+    *p = f->next;
+
+    f->data   = data;
+    f->length = length;
+    f->done   = true;
+    if (f->followers) {
+        pthread_cond_broadcast(&Done);
+    }
+    flight_put(f);
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Return result shared by leader of finished flight (and set length), or NULL
+ * if there is none.  The result remains valid until flight_release.
+ **/
+const char *
+flight_result(struct flight *f, size_t *length)
+{
+    *length = f->length;
+    return f->data;
+}
+
+/**
+ * Release flight as a follower.
+ **/
+void
+flight_release(struct flight *f)
+{
+    if (f == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&Lock);
+    flight_put(f);
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Write request coalescing statistics to connection as plain text.
+ **/
+void
+flight_write_status(struct conn *c)
+{
+    size_t leaders;
+    size_t followers;
+    size_t timeouts;
+
+    pthread_mutex_lock(&Lock);
+    leaders   = Leaders;
+    followers = Followers;
+    timeouts  = Timeouts;
+    pthread_mutex_unlock(&Lock);
+
+    conn_printf(c, "flight.leaders %zu\n", leaders);
+    conn_printf(c, "flight.coalesced %zu\n", followers);
+    conn_printf(c, "flight.timeouts %zu\n", timeouts);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -22,14 +22,28 @@ forking_server(int sfd)
 
     /* Accept and handle HTTP request */
     while (true) {
-    	/* Accept request */
-
-	/* Ignore children */
-
-	/* Fork off child process to handle request */
+        /* Accept request */
+        if ((request = accept_request(sfd)) == NULL) {
+            continue;
+        }
+
+        /* Ignore children */
+        signal(SIGCHLD, SIG_IGN);
+
+        /* Fork off child process to handle request */
+        if ((pid = fork()) < 0) {
+            fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        } else if (pid == 0) {
+            close(sfd);
+            handle_request(request);
+            free_request(request);
+            exit(EXIT_SUCCESS);
+        }
+        free_request(request);
     }
 
     /* Close server socket and exit*/
+    close(sfd);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,18 +2,43 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <time.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define BROWSE_STREAM_MIN   (1024 * 1024)	/* Directories this large are streamed */
+#define BROWSE_BATCH	    (64 * 1024)		/* Bytes of entries read per getdents64 */
+#define BROWSE_CHUNK	    (16 * 1024)		/* Listing bytes sent per chunk */
+#define BROWSE_HREF_MAX	    (3 * NAME_MAX + 1)	/* Percent-encoded entry name */
+#define BROWSE_TEXT_MAX	    (6 * NAME_MAX + 1)	/* HTML-escaped entry name */
+#define CGI_CACHE_RULES_MAX 64			/* Scripts with a response cache TTL */
+#define CGI_PIPE_SIZE	    (1024 * 1024)	/* CGI output pipe capacity */
+#define CGI_SPLICE_MAX	    (1024 * 1024)	/* CGI output bytes spliced per call */
+#define ERROR_RESPONSE_MAX  512			/* Longest prepared error response */
+#define RESPONSE_CACHE_MAX  (8 * 1024)		/* Files this small get full responses cached */
+#define RESPONSE_DATE_OFFSET (sizeof("HTTP/1.0 200 OK\r\nDate: ") - 1)
+
 /* Internal Declarations */
 http_status handle_browse_request(struct request *request);
 http_status handle_file_request(struct request *request);
 http_status handle_cgi_request(struct request *request);
-http_status handle_error(struct request *request, http_status status);
+http_status handle_status_request(struct request *request);
 
 /**
  * Handle HTTP Request
@@ -29,115 +54,1775 @@ handle_request(struct request *r)
     http_status result;
 
     /* Parse request */
+    if (parse_request(r) < 0) {
+        return handle_error(r, r->parser.status);
+    }
+
+    /* Serve server status page */
+    if (StatusPath && streq(r->uri, StatusPath)) {
+        result = handle_status_request(r);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result;
+    }
+
+    /* Serve file from site snapshot (without touching the filesystem) */
+    if (SnapshotMax > 0 && snapshot_handle(r, &result)) {
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result;
+    }
 
     /* Determine request path */
+    if ((r->path = determine_request_path(r->uri, &r->file)) == NULL) {
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+    r->pathfd = r->file->fd;
+    r->st     = r->file->st;
     debug("HTTP REQUEST PATH: %s", r->path);
 
     /* Dispatch to appropriate request handler type */
+    switch (determine_request_type(&r->st)) {
+        case REQUEST_BROWSE:
+            result = handle_browse_request(r);
+            break;
+        case REQUEST_FILE:
+            result = handle_file_request(r);
+            break;
+        case REQUEST_CGI:
+            result = handle_cgi_request(r);
+            break;
+        default:
+            result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+            break;
+    }
 
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
     return result;
 }
 
 /**
- * Handle browse request
+ * Format URI path of directory being listed (ending in "/"), percent-encoded,
+ * into buffer (of size n).
  *
- * This lists the contents of a directory in HTML.
+ * Returns the length of the path, or -1 if it does not fit.
+ **/
+static int
+browse_base(struct request *r, char *buffer, size_t n)
+{
+    char path[PATH_MAX + 2];
+
+    if (streq(r->file->key, ".")) {
+        snprintf(path, sizeof(path), "/");
+    } else {
+        snprintf(path, sizeof(path), "/%s/", r->file->key);
+    }
+    return escape_uri(path, buffer, n);
+}
+
+/**
+ * Escape directory entry name for list item: percent-encoded for the link
+ * (href) and HTML-escaped for its text.
  *
- * If the path cannot be opened or scanned as a directory, then handle error
- * with HTTP_STATUS_NOT_FOUND.
+ * Returns 0 on success, -1 if the name is too long.
  **/
-http_status
-handle_browse_request(struct request *r)
+static int
+browse_escape(const char *name, char href[BROWSE_HREF_MAX], char text[BROWSE_TEXT_MAX])
+{
+    if (escape_uri(name, href, BROWSE_HREF_MAX) < 0 || escape_html(name, text, BROWSE_TEXT_MAX) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Render HTML listing of directory, sorted by name (compressed with coding, if
+ * not NULL and worthwhile).  Only limit entries (0 for all) starting at
+ * offset are listed.
+ *
+ * Returns newly allocated listing (and sets length, and clears coding if the
+ * listing was not compressed) on success, NULL on error.
+ **/
+static char *
+browse_render(struct request *r, size_t offset, size_t limit, const char **coding, size_t *length)
 {
     struct dirent **entries;
     int n;
+    char   base[3 * (PATH_MAX + 2)];
+    char   href[BROWSE_HREF_MAX];
+    char   text[BROWSE_TEXT_MAX];
+    char  *listing;
+    char  *compressed;
+    size_t clength;
+    size_t index = 0;
+    FILE  *stream;
 
     /* Open a directory for reading or scanning */
+    if (browse_base(r, base, sizeof(base)) < 0) {
+        return NULL;
+    }
+    if ((n = scandir(r->path, &entries, NULL, alphasort)) < 0) {
+        debug("Unable to scan %s: %s", r->path, strerror(errno));
+        return NULL;
+    }
+
+    /* For each entry in directory, render HTML list item */
+    if ((stream = open_memstream(&listing, length)) == NULL) {
+        for (int i = 0; i < n; i++) {
+            free(entries[i]);
+        }
+        free(entries);
+        return NULL;
+    }
+    fprintf(stream, "<ul>\n");
+    for (int i = 0; i < n; i++) {
+        if (!streq(entries[i]->d_name, ".") && index++ >= offset && (limit == 0 || index <= offset + limit) &&
+            browse_escape(entries[i]->d_name, href, text) == 0) {
+            fprintf(stream, "<li><a href=\"%s%s\">%s</a></li>\n", base, href, text);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    fprintf(stream, "</ul>\n");
+    fclose(stream);
+
+    /* Compress listing, if worthwhile */
+    if (*coding && *length >= COMPRESS_MIN &&
+        (compressed = compress_buffer(listing, *length, *coding, &clength))) {
+        free(listing);
+        listing = compressed;
+        *length = clength;
+    } else {
+        *coding = NULL;
+    }
+    return listing;
+}
+
+/* Streamed listing output */
+struct browse_output {
+    struct request *r;
+    bool	    chunked;		/* Use chunked transfer coding */
+    char	    data[BROWSE_CHUNK];	/* Pending chunk */
+    size_t	    length;		/* Bytes in pending chunk */
+};
+
+/**
+ * Send pending listing output as one chunk.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+browse_flush(struct browse_output *b)
+{
+    struct iovec iov[3];
+    char size[32];
+    int n = 0;
+
+    if (b->length == 0) {
+        return 0;
+    }
+    if (b->chunked) {
+        iov[n++] = (struct iovec){size, snprintf(size, sizeof(size), "%zx\r\n", b->length)};
+    }
+    iov[n++] = (struct iovec){b->data, b->length};
+    if (b->chunked) {
+        iov[n++] = (struct iovec){"\r\n", 2};
+    }
+    b->length = 0;
+    return conn_writev(&b->r->conn, iov, n);
+}
+
+/**
+ * Append formatted listing output, sending a chunk whenever it fills up.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+browse_printf(struct browse_output *b, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_start(args, format);
+        n = vsnprintf(b->data + b->length, sizeof(b->data) - b->length, format, args);
+        va_end(args);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < sizeof(b->data) - b->length) {
+            b->length += n;
+            return 0;
+        }
+        if (b->length == 0 || browse_flush(b) < 0) {
+            break;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Stream listing of directory in directory order, as entries are read in
+ * batches with getdents64, so that neither memory nor time to first byte
+ * grows with the size of the directory.
+ *
+ * HTTP/1.1 clients get the listing with chunked transfer coding, one chunk
+ * per batch; HTTP/1.0 clients get it delimited by the connection closing.
+ * Only limit entries (0 for all) starting at offset are listed.
+ **/
+static http_status
+browse_stream(struct request *r, size_t offset, size_t limit)
+{
+    struct browse_output *b;
+    struct head h;
+    char    base[3 * (PATH_MAX + 2)];
+    char    href[BROWSE_HREF_MAX];
+    char    text[BROWSE_TEXT_MAX];
+    char    head[BUFSIZ];
+    char   *batch;
+    size_t  index = 0;
+    ssize_t nread;
+    int     fd;
+
+    /* Open a private descriptor (reading entries moves its position) */
+    if (browse_base(r, base, sizeof(base)) < 0) {
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+    if ((fd = openat(r->pathfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        debug("Unable to open %s: %s", r->path, strerror(errno));
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+    if ((b = calloc(1, sizeof(struct browse_output))) == NULL || (batch = malloc(BROWSE_BATCH)) == NULL) {
+        free(b);
+        close(fd);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    b->r       = r;
+    b->chunked = r->version >= 11;
 
     /* Write HTTP Header with OK Status and text/html Content-Type */
+    head_start(&h, head, sizeof(head), HTTP_STATUS_OK, b->chunked ? 11 : 10);
+    head_add(&h, HEADER_CONTENT_TYPE, "text/html");
+    if (b->chunked) {
+        head_add(&h, HEADER_TRANSFER_ENCODING, "chunked");
+        head_add(&h, HEADER_CONNECTION, "close");
+    }
+    head_write(&h, &r->conn);
+
+    /* For each batch of entries, emit HTML list items as one chunk */
+    int status = browse_printf(b, "<ul>\n");
+    while (status == 0 && (limit == 0 || index < offset + limit) &&
+           (nread = syscall(SYS_getdents64, fd, batch, BROWSE_BATCH)) > 0) {
+        for (char *p = batch; p < batch + nread && (limit == 0 || index < offset + limit); ) {
+            struct {
+                ino64_t        d_ino;
+                off64_t        d_off;
+                unsigned short d_reclen;
+                unsigned char  d_type;
+                char           d_name[];
+            } *entry = (void *)p;
 
-    /* For each entry in directory, emit HTML list item */
+            p += entry->d_reclen;
+            if (streq(entry->d_name, ".") || index++ < offset || browse_escape(entry->d_name, href, text) < 0) {
+                continue;
+            }
+            if ((status = browse_printf(b, "<li><a href=\"%s%s\">%s</a></li>\n", base, href, text)) < 0) {
+                break;
+            }
+        }
+        if (status == 0) {
+            status = browse_flush(b);
+        }
+    }
+    if (status == 0 && browse_printf(b, "</ul>\n") == 0 && browse_flush(b) == 0 && b->chunked) {
+        conn_write(&r->conn, "0\r\n\r\n", 5);
+    }
 
     /* Flush socket, return OK */
+    conn_flush(&r->conn);
+    close(fd);
+    free(batch);
+    free(b);
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Handle browse request
+ *
+ * This lists the contents of a directory in HTML.  The listing is rendered in
+ * memory, so it can be sent with a Content-Length and compressed (if the
+ * client accepts it and it is large enough to be worth it).
+ *
+ * Rendered listings are kept in the file cache (keyed by the normalized
+ * directory path and the offset, limit, and coding it was rendered with, and
+ * validated by the directory's status, which changes with its entries), so a
+ * repeated listing costs a single write of the cached bytes, while other
+ * spellings of the URI or unrelated query parameters share its entry.
+ *
+ * Listings may be paginated with "?offset=n&limit=n".  With "?sort=none",
+ * or for very large directories, the listing is streamed unsorted instead
+ * (see browse_stream).
+ *
+ * If offset or limit is not a plain number, then handle error with
+ * HTTP_STATUS_BAD_REQUEST.  If the path cannot be opened or scanned as a
+ * directory, then handle error with HTTP_STATUS_NOT_FOUND.
+ **/
+http_status
+handle_browse_request(struct request *r)
+{
+    struct cache_entry *entry = NULL;
+    const char *coding = compress_coding(request_header(r, "Accept-Encoding"));
+    const char *value;
+    char   param[NUMBER_MAX + 1];
+    size_t offset = 0;
+    size_t limit  = 0;
+    char  *listing = NULL;
+    size_t length;
+    char   key[PATH_MAX];
+    bool   keyed;
+    char   head[BUFSIZ];
+    struct head h;
+
+    /* Parse pagination (rejecting anything but plain numbers) */
+    if (((value = query_param(r->query, "offset", param, sizeof(param))) && parse_number(value, &offset) < 0) ||
+        ((value = query_param(r->query, "limit", param, sizeof(param))) && parse_number(value, &limit) < 0)) {
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    }
+
+    /* Stream unsorted listing of very large directories (or on request) */
+    if (((value = query_param(r->query, "sort", param, sizeof(param))) && streq(value, "none")) ||
+        r->st.st_size >= BROWSE_STREAM_MIN) {
+        return browse_stream(r, offset, limit);
+    }
+
+    /* Lookup rendered listing in cache (rendering it on a miss) */
+    keyed = snprintf(key, sizeof(key), "%s;listing;%zu;%zu;%s",
+                     r->file->key, offset, limit, coding ? coding : "identity") < (int)sizeof(key);
+    if (keyed && (entry = cache_lookup(key, &r->st))) {
+        coding = entry->type;
+    } else {
+        if ((listing = browse_render(r, offset, limit, &coding, &length)) == NULL) {
+            return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        }
+        if (keyed && cache_fits(length)) {
+            entry   = cache_insert_data(key, &r->st, listing, length, coding, 0);
+            listing = NULL;
+            if (entry == NULL) {
+                return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+            }
+        }
+    }
+    if (entry) {
+        length = entry->length;
+    }
+
+    /* Write HTTP Header with OK Status and text/html Content-Type */
+    head_start(&h, head, sizeof(head), HTTP_STATUS_OK, 10);
+    head_add(&h, HEADER_CONTENT_TYPE, "text/html");
+    head_add_number(&h, HEADER_CONTENT_LENGTH, length);
+    if (coding) {
+        head_add(&h, HEADER_CONTENT_ENCODING, coding);
+    }
+    if (CompressLevel > 0) {
+        head_add(&h, HEADER_VARY, "Accept-Encoding");
+    }
+    head_write(&h, &r->conn);
+
+    /* Send listing, return OK */
+    struct iovec iov = {entry ? entry->data : listing, length};
+    conn_writev(&r->conn, &iov, 1);
+    cache_release(entry);
+    free(listing);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Determine whether If-Range validator (an entity tag or a date) still
+ * matches the file (so that the Range header applies).
+ **/
+static bool
+file_if_range_matches(struct request *r, const char *validator, const char *etag)
+{
+    if (validator[0] == '"' || strncmp(validator, "W/", 2) == 0) {
+        return etag_matches(validator, etag, true);
+    }
+    return parse_http_date(validator) == r->st.st_mtim.tv_sec;
+}
+
+/**
+ * Determine whether the client's cached copy of the file is still current
+ * (If-None-Match, or If-Modified-Since in its absence).
+ **/
+static bool
+file_not_modified(struct request *r, const char *etag)
+{
+    const char *value;
+    time_t since;
+
+    if (!streq(r->method, "GET") && !streq(r->method, "HEAD")) {
+        return false;
+    }
+    if ((value = request_header(r, "If-None-Match"))) {
+        return etag_matches(value, etag, false);
+    }
+    if ((value = request_header(r, "If-Modified-Since")) && (since = parse_http_date(value)) >= 0) {
+        return r->st.st_mtim.tv_sec <= since;
+    }
+    return false;
+}
+
+/**
+ * Determine byte ranges requested for file (see parse_ranges).
+ *
+ * Returns the number of satisfiable ranges, or -1 if the whole file should be
+ * sent (no Range header, not a GET, a stale If-Range, or a Range that must be
+ * ignored).
+ **/
+static int
+file_ranges(struct request *r, struct range *ranges, off_t size, const char *etag)
+{
+    const char *range = request_header(r, "Range");
+    const char *if_range;
+
+    if (range == NULL || !streq(r->method, "GET")) {
+        return -1;
+    }
+    if ((if_range = request_header(r, "If-Range")) && !file_if_range_matches(r, if_range, etag)) {
+        return -1;
+    }
+    return parse_ranges(range, size, ranges, RANGES_MAX);
+}
+
+/**
+ * Send length bytes of file starting at offset: from the cached contents if
+ * there are any, otherwise with sendfile from the file's descriptor (waiting
+ * whenever the socket is full).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+file_send(struct request *r, struct cache_entry *entry, off_t offset, off_t length)
+{
+    off_t end = offset + length;
+    ssize_t nsent;
+
+    if (entry) {
+        struct iovec iov = {entry->data + offset, length};
+        return conn_writev(&r->conn, &iov, 1);
+    }
+
+    while (offset < end) {
+        if ((nsent = conn_sendfile(&r->conn, r->pathfd, &offset, end - offset)) < 0) {
+            if (errno == EAGAIN && conn_wait(&r->conn, POLLOUT) == 0) {
+                continue;
+            }
+            debug("Unable to send %s: %s", r->path, strerror(errno));
+            return -1;
+        }
+        if (nsent == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Format header of multipart/byteranges part for range into buffer (of size
+ * n, which may be 0 to only measure it).
+ *
+ * Returns the length of the part header.
+ **/
+static int
+file_part_header(char *buffer, size_t n, const char *boundary, const char *type, const struct range *range, off_t size)
+{
+    return snprintf(buffer, n, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        boundary, type, (long long)range->first, (long long)range->last, (long long)size);
+}
+
+/* Precompressed siblings, in order of preference */
+static const struct {
+    const char *coding;     /* Content coding (as in Accept-Encoding) */
+    const char *suffix;     /* Suffix of sibling file */
+} Siblings[] = {
+    {"br",      ".br"},
+    {"gzip",    ".gz"},
+};
+
+/**
+ * Find precompressed sibling of file (e.g. foo.html.br for foo.html) that the
+ * client accepts.
+ *
+ * Siblings are opened through the descriptor cache, which also remembers
+ * missing files, so once warm this makes no syscalls.  Sets vary if the file
+ * has any sibling at all, since the response then depends on Accept-Encoding.
+ *
+ * Returns the sibling's descriptor cache entry and sets coding, or NULL if
+ * the file itself should be sent.
+ **/
+static struct fd_entry *
+file_sibling(struct request *r, const char **coding, bool *vary)
+{
+    const char *accept = request_header(r, "Accept-Encoding");
+    char relative[PATH_MAX];
+
+    *vary = false;
+    for (size_t i = 0; i < sizeof(Siblings) / sizeof(Siblings[0]); i++) {
+        struct fd_entry *sibling;
+
+        snprintf(relative, sizeof(relative), "%s%s", r->file->key, Siblings[i].suffix);
+        if ((sibling = fdcache_open(relative)) == NULL) {
+            continue;
+        }
+        if (S_ISREG(sibling->st.st_mode)) {
+            *vary = true;
+            if (accept && accepts_encoding(accept, Siblings[i].coding)) {
+                *coding = Siblings[i].coding;
+                return sibling;
+            }
+        }
+        fdcache_release(sibling);
+    }
+    return NULL;
+}
+
+/**
+ * Determine whether file is worth compressing on the fly: its type is not
+ * already compressed, and it is neither tiny nor too large to keep the
+ * compressed variant in the file cache.
+ **/
+static bool
+file_compressible(struct request *r, const char *type)
+{
+    return CompressLevel > 0 && r->st.st_size >= COMPRESS_MIN && cache_fits(r->st.st_size) && compress_type(type);
+}
+
+/**
+ * Compress file with content coding and cache the result under key (so each
+ * file is only compressed once, until it changes).
+ *
+ * Returns the cache entry holding the compressed variant, or NULL if the file
+ * could not be compressed (or the variant not cached).
+ **/
+static struct cache_entry *
+file_compress(struct request *r, const char *key, const char *coding, const char *type)
+{
+    struct cache_entry *identity = cache_lookup(r->path, &r->st);
+    size_t size = r->st.st_size;
+    char  *data = NULL;
+    char  *compressed;
+    size_t length;
+
+    /* Compress from the cached contents, or read the file */
+    if (identity == NULL) {
+        if ((data = malloc(size)) == NULL) {
+            return NULL;
+        }
+        for (size_t offset = 0; offset < size; ) {
+            ssize_t nread = pread(r->pathfd, data + offset, size - offset, offset);
+            if (nread <= 0) {
+                debug("Unable to read %s: %s", r->path, nread < 0 ? strerror(errno) : "short read");
+                free(data);
+                return NULL;
+            }
+            offset += nread;
+        }
+    }
+
+    compressed = compress_buffer(identity ? identity->data : data, size, coding, &length);
+    cache_release(identity);
+    free(data);
+    if (compressed == NULL) {
+        return NULL;
+    }
+    return cache_insert_data(key, &r->st, compressed, length, type, 0);
+}
+
+/**
+ * Add representation headers shared by all file responses to head.
+ **/
+static void
+file_headers(struct head *h, const char *etag, const char *modified, const char *coding, bool vary)
+{
+    head_add(h, HEADER_ETAG, etag);
+    head_add(h, HEADER_LAST_MODIFIED, modified);
+    if (coding) {
+        head_add(h, HEADER_CONTENT_ENCODING, coding);
+    }
+    if (vary) {
+        head_add(h, HEADER_VARY, "Accept-Encoding");
+    }
+}
+
+/**
+ * Keep complete 200 OK response (head and contents) for small file in cache
+ * under key.
+ **/
+static void
+file_response_insert(struct request *r, const char *key, const char *head, size_t length, const struct cache_entry *entry)
+{
+    char *response;
+
+    if ((response = malloc(length + entry->length)) == NULL) {
+        return;
+    }
+    memcpy(response, head, length);
+    memcpy(response + length, entry->data, entry->length);
+    cache_release(cache_insert_data(key, &r->st, response, length + entry->length, NULL, 0));
+}
+
+/**
+ * Send complete response from full response cache with the current Date.
+ **/
+static void
+file_response_send(struct request *r, const struct cache_entry *entry)
+{
+    char date[DATE_MAX];
+    struct iovec iov[3] = {
+        {entry->data, RESPONSE_DATE_OFFSET},
+        {date, DATE_LENGTH},
+        {entry->data + RESPONSE_DATE_OFFSET + DATE_LENGTH, entry->length - RESPONSE_DATE_OFFSET - DATE_LENGTH},
+    };
+
+    format_http_now(date, sizeof(date));
+    conn_writev(&r->conn, iov, 3);
+}
+
 /**
  * Handle file request
  *
- * This opens and streams the contents of the specified file to the socket.
+ * Hot files are served from the file cache: the headers and the cached
+ * contents go out in a single writev.  Otherwise, the contents of the
+ * specified file (already opened by determine_request_path) are streamed to
+ * the socket with sendfile, so the body goes straight from the page cache to
+ * the socket.
+ *
+ * If the client accepts it, a precompressed sibling (foo.html.br or
+ * foo.html.gz) is sent in place of the file, with the file's Content-Type and
+ * the sibling's Content-Encoding (and its own validators and ranges).
+ * Otherwise, compressible files are compressed on the fly (gzip or deflate)
+ * and the compressed variant kept in the file cache.
+ *
+ * Every response carries an ETag and Last-Modified derived from the file's
+ * status, and requests whose validators still match are answered with 304
+ * Not Modified from that status alone, before the file is read.
+ *
+ * Complete 200 OK responses for small files (head and contents) are kept in
+ * the file cache as well, so a hit costs one writev of the prepared response
+ * with the current Date spliced in.
+ *
+ * Byte range requests are answered with 206 Partial Content: one range as is,
+ * several as multipart/byteranges.  Only the requested extents are sent (by
+ * offset, from the cache or with sendfile).  Unsatisfiable ranges get 416
+ * Range Not Satisfiable.
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * If the path cannot be read, then handle error with HTTP_STATUS_NOT_FOUND.
  **/
 http_status
 handle_file_request(struct request *r)
 {
-    FILE *fs;
+    struct cache_entry *entry;
+    struct fd_entry *sibling;
+    struct flight *flight;
+    struct range ranges[RANGES_MAX];
+    struct head h;
+    const char *type;
+    const char *coding = NULL;
+    const char *compress = NULL;
+    bool vary;
+    bool leader;
+    bool keyed = true;
+    char key[PATH_MAX];
+    char response[PATH_MAX + 16];
+    char head[BUFSIZ];
+    char etag[ETAG_MAX];
+    char modified[DATE_MAX];
+    off_t size;
+    int nranges;
+
+    /* Determine mimetype from the requested name */
+    if ((type = fdcache_mimetype(r->file, r->path)) == NULL) {
+        type = DefaultMimeType;
+    }
+
+    /* Send precompressed sibling instead of file, if there is one, or else
+     * compress the file on the fly, if worthwhile */
+    if ((sibling = file_sibling(r, &coding, &vary))) {
+        fdcache_release(r->file);
+        r->file   = sibling;
+        r->pathfd = sibling->fd;
+        r->st     = sibling->st;
+        keyed     = snprintf(key, sizeof(key), "%s;%s", r->path, coding) < (int)sizeof(key);
+    } else if (file_compressible(r, type)) {
+        vary = true;
+        if ((compress = coding = compress_coding(request_header(r, "Accept-Encoding"))) &&
+            snprintf(key, sizeof(key), "%s;%s", r->path, coding) >= (int)sizeof(key)) {
+            compress = coding = NULL;   /* Variant cannot be cached: send as is */
+        }
+    }
+    if (coding == NULL) {
+        snprintf(key, sizeof(key), "%s", r->path);
+    }
+
+    format_etag(&r->st, etag, sizeof(etag));
+    if (compress) {
+        size_t n = strlen(etag);
+        snprintf(etag + n - 1, sizeof(etag) - n + 1, "-%s\"", compress);
+    }
+    format_http_date(r->st.st_mtim.tv_sec, modified, sizeof(modified));
+
+    /* Answer conditional requests from file status */
+    if (file_not_modified(r, etag)) {
+        head_start(&h, head, sizeof(head), HTTP_STATUS_NOT_MODIFIED, 10);
+        file_headers(&h, etag, modified, coding, vary);
+        head_write(&h, &r->conn);
+        conn_flush(&r->conn);
+        return HTTP_STATUS_NOT_MODIFIED;
+    }
+
+    /* Send complete response for small file from cache */
+    snprintf(response, sizeof(response), "%s;response", key);
+    if (keyed && r->st.st_size <= RESPONSE_CACHE_MAX && request_header(r, "Range") == NULL &&
+        (entry = cache_lookup(response, &r->st))) {
+        file_response_send(r, entry);
+        cache_release(entry);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Lookup file (or its compressed variant) in cache, loading it on a
+     * miss; if the file cannot be compressed, send it as is.  Concurrent
+     * misses for the same key wait for the first one to load it (see
+     * flight_join) and then find it in the cache. */
+    entry = NULL;
+    if (keyed && (entry = cache_lookup(key, &r->st)) == NULL && (compress || cache_fits(r->st.st_size))) {
+        if ((flight = flight_join(key, &leader)) && !leader) {
+            entry = cache_lookup(key, &r->st);
+        }
+        if (entry == NULL && compress && (entry = file_compress(r, key, compress, type)) == NULL) {
+            compress = coding = NULL;
+            snprintf(key, sizeof(key), "%s", r->path);
+            format_etag(&r->st, etag, sizeof(etag));
+            entry = cache_lookup(key, &r->st);
+        }
+        if (entry == NULL && compress == NULL) {
+            entry = cache_insert(key, &r->st, r->pathfd, type);
+        }
+        if (flight && leader) {
+            flight_finish(flight, NULL, 0);
+        } else {
+            flight_release(flight);
+        }
+    }
+    size = entry ? (off_t)entry->length : r->st.st_size;
+
+    /* Reject unsatisfiable ranges */
+    if ((nranges = file_ranges(r, ranges, size, etag)) == 0) {
+        head_start(&h, head, sizeof(head), HTTP_STATUS_RANGE_NOT_SATISFIABLE, 10);
+        head_add_range(&h, NULL, size);
+        file_headers(&h, etag, modified, coding, vary);
+        head_add_number(&h, HEADER_CONTENT_LENGTH, 0);
+        head_write(&h, &r->conn);
+        conn_flush(&r->conn);
+        cache_release(entry);
+        return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    }
+
+    if (nranges < 0) {
+        /* Write HTTP Headers with OK status and determined Content-Type (and
+         * keep the complete response of a small file); the Date comes right
+         * after the status line, at RESPONSE_DATE_OFFSET, so that it can be
+         * replaced in cached responses */
+        ssize_t length;
+
+        head_start(&h, head, sizeof(head), HTTP_STATUS_OK, 10);
+        head_add(&h, HEADER_CONTENT_TYPE, type);
+        head_add_number(&h, HEADER_CONTENT_LENGTH, size);
+        head_add(&h, HEADER_ACCEPT_RANGES, "bytes");
+        file_headers(&h, etag, modified, coding, vary);
+        if ((length = head_finish(&h)) < 0) {
+            cache_release(entry);
+            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
+        if (entry && r->st.st_size <= RESPONSE_CACHE_MAX && request_header(r, "Range") == NULL) {
+            snprintf(response, sizeof(response), "%s;response", key);
+            file_response_insert(r, response, head, length, entry);
+        }
+        conn_write(&r->conn, head, length);
+        file_send(r, entry, 0, size);
+    } else if (nranges == 1) {
+        /* Single range: send extent with Content-Range */
+        head_start(&h, head, sizeof(head), HTTP_STATUS_PARTIAL_CONTENT, 10);
+        head_add(&h, HEADER_CONTENT_TYPE, type);
+        head_add_range(&h, &ranges[0], size);
+        head_add_number(&h, HEADER_CONTENT_LENGTH, ranges[0].last - ranges[0].first + 1);
+        file_headers(&h, etag, modified, coding, vary);
+        head_write(&h, &r->conn);
+        file_send(r, entry, ranges[0].first, ranges[0].last - ranges[0].first + 1);
+    } else {
+        /* Several ranges: send each extent as a multipart/byteranges part */
+        char boundary[64];
+        char multipart[96];
+        off_t length;
+
+        snprintf(boundary, sizeof(boundary), "%llx%llx",
+            (unsigned long long)r->st.st_ino, (unsigned long long)r->st.st_mtim.tv_sec);
+        snprintf(multipart, sizeof(multipart), "multipart/byteranges; boundary=%s", boundary);
+
+        length = strlen("\r\n----\r\n") + strlen(boundary);
+        for (int i = 0; i < nranges; i++) {
+            length += file_part_header(NULL, 0, boundary, type, &ranges[i], size);
+            length += ranges[i].last - ranges[i].first + 1;
+        }
+
+        head_start(&h, head, sizeof(head), HTTP_STATUS_PARTIAL_CONTENT, 10);
+        head_add(&h, HEADER_CONTENT_TYPE, multipart);
+        head_add_number(&h, HEADER_CONTENT_LENGTH, length);
+        file_headers(&h, etag, modified, coding, vary);
+        head_write(&h, &r->conn);
+        int i;
+        for (i = 0; i < nranges; i++) {
+            char header[BUFSIZ];
+            int  n = file_part_header(header, sizeof(header), boundary, type, &ranges[i], size);
+
+            if (conn_write(&r->conn, header, n) < 0 ||
+                file_send(r, entry, ranges[i].first, ranges[i].last - ranges[i].first + 1) < 0) {
+                break;
+            }
+        }
+        if (i == nranges) {             /* Stop writing once a part failed */
+            conn_printf(&r->conn, "\r\n--%s--\r\n", boundary);
+        }
+    }
+
+    /* Flush socket, release cache entry */
+    conn_flush(&r->conn);
+    cache_release(entry);
+    return nranges < 0 ? HTTP_STATUS_OK : HTTP_STATUS_PARTIAL_CONTENT;
+}
+
+/**
+ * Find end of CGI header block (the blank line) in buffer.
+ *
+ * Returns the length of the header block including the blank line, or 0 if
+ * the block is not complete.
+ **/
+size_t
+cgi_head_length(const char *buffer, size_t n)
+{
+    for (const char *c = buffer; (c = memchr(c, '\n', buffer + n - c)); c++) {
+        if (c + 1 < buffer + n && c[1] == '\n') {
+            return c + 2 - buffer;
+        }
+        if (c + 2 < buffer + n && c[1] == '\r' && c[2] == '\n') {
+            return c + 3 - buffer;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Lookup header in CGI header block (case-insensitive).
+ *
+ * Returns pointer to the value (terminated by the end of its line, whose
+ * length is stored in length), or NULL if there is no such header.
+ **/
+const char *
+cgi_head_value(const char *head, size_t n, const char *name, size_t *length)
+{
+    size_t name_length = strlen(name);
+
+    for (const char *line = head, *end; line < head + n; line = end + 1) {
+        if ((end = memchr(line, '\n', head + n - line)) == NULL) {
+            break;
+        }
+        if ((size_t)(end - line) > name_length && line[name_length] == ':' &&
+            strncasecmp(line, name, name_length) == 0) {
+            const char *value = line + name_length + 1;
+            for (; value < end && (*value == ' ' || *value == '\t'); value++);
+            *length = end - value - (end > value && end[-1] == '\r');
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write CGI header block to connection for a compressed body: Content-Length
+ * is dropped and Content-Encoding and Vary are added.
+ **/
+static void
+cgi_write_compressed_head(struct request *r, const char *head, size_t n, const char *coding)
+{
+    const char *blank = head + n - (head[n - 2] == '\r' ? 2 : 1);
+
+    for (const char *line = head, *end; line < blank; line = end + 1) {
+        end = memchr(line, '\n', blank - line);
+        if (strncasecmp(line, "Content-Length:", 15) != 0) {
+            conn_write(&r->conn, line, end + 1 - line);
+        }
+    }
+    conn_printf(&r->conn, "Content-Encoding: %s\r\n", coding);
+    conn_printf(&r->conn, "Vary: Accept-Encoding\r\n");
+    conn_printf(&r->conn, "\r\n");
+}
+
+/**
+ * Build CGI environment for request
+ *
+ * This returns a NULL-terminated array of "NAME=value" strings with the CGI
+ * meta-variables (http://en.wikipedia.org/wiki/Common_Gateway_Interface) and
+ * an HTTP_* variable for each request header.  The array and its strings are
+ * allocated as one block that must later be free'd.
+ *
+ * Returns the environment on success, NULL on error.
+ **/
+char **
+cgi_environment(struct request *r)
+{
+    const char *content_length = request_header(r, "Content-Length");
+    const char *content_type   = request_header(r, "Content-Type");
+    const char *variables[][2] = {
+        {"DOCUMENT_ROOT",       RootPath},
+        {"GATEWAY_INTERFACE",   "CGI/1.1"},
+        {"PATH",                getenv("PATH")},
+        {"QUERY_STRING",        r->query},
+        {"REMOTE_ADDR",         r->host},
+        {"REMOTE_PORT",         r->port},
+        {"REQUEST_METHOD",      r->method},
+        {"REQUEST_URI",         r->uri},
+        {"SCRIPT_FILENAME",     r->path},
+        {"SCRIPT_NAME",         r->uri},
+        {"SERVER_PORT",         Port},
+        {"SERVER_PROTOCOL",     r->version >= 11 ? "HTTP/1.1" : "HTTP/1.0"},
+        {"CONTENT_LENGTH",      content_length},
+        {"CONTENT_TYPE",        content_type},
+    };
+    size_t nvariables = sizeof(variables) / sizeof(variables[0]);
+    size_t count = nvariables;
+    size_t size;
+    char **envp;
+    char  *s;
+
+    /* Measure variables and headers */
+    size = 0;
+    for (size_t i = 0; i < nvariables; i++) {
+        size += variables[i][1] ? strlen(variables[i][0]) + strlen(variables[i][1]) + 2 : 0;
+    }
+    for (struct header *header = r->headers; header; header = header->next) {
+        size += strlen("HTTP_") + strlen(header->name) + strlen(header->value) + 2;
+        count++;
+    }
+
+    if ((envp = malloc((count + 1) * sizeof(char *) + size)) == NULL) {
+        return NULL;
+    }
+    s = (char *)(envp + count + 1);
+    count = 0;
+
+    /* Copy meta-variables (skipping ones that are not set) */
+    for (size_t i = 0; i < nvariables; i++) {
+        if (variables[i][1]) {
+            envp[count++] = s;
+            s += sprintf(s, "%s=%s", variables[i][0], variables[i][1]) + 1;
+        }
+    }
+
+    /* Copy request headers as HTTP_* variables */
+    for (struct header *header = r->headers; header; header = header->next) {
+        envp[count++] = s;
+        s += sprintf(s, "HTTP_");
+        for (const char *c = header->name; *c; c++) {
+            *s++ = (*c == '-') ? '_' : toupper((unsigned char)*c);
+        }
+        s += sprintf(s, "=%s", header->value) + 1;
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+/* CGI request body forwarded to the script's standard input (see cgi_pump) */
+struct cgi_input {
+    struct request *r;
+    int		    fd;			/* Server end of script's input (-1 if none) */
+    size_t	    remaining;		/* Body bytes left to forward */
+    bool	    done;		/* Forwarding finished */
+    pthread_t	    thread;		/* Forwarding thread */
+};
+
+/**
+ * Forward request body (from the read-ahead buffer, then the socket) to CGI
+ * script's standard input, then signal the end of its input.
+ *
+ * This runs in its own thread while the request's thread relays the script's
+ * output, since a script may write output before it drains its input: if the
+ * output were only read after the whole body was forwarded, both could block
+ * forever on full pipes.  Forwarding stops early if the client goes away, or
+ * if the script exits (or closes its input) without reading all of it.
+ **/
+static void *
+cgi_pump(void *arg)
+{
+    struct cgi_input *in = arg;
+    char buffer[CONN_BUFSIZ];
+
+    while (in->remaining > 0) {
+        ssize_t nread = conn_read(&in->r->conn, buffer, in->remaining < sizeof(buffer) ? in->remaining : sizeof(buffer));
+        if (nread <= 0) {
+            break;
+        }
+        in->remaining -= nread;
+
+        char *p = buffer;
+        while (nread > 0) {
+            ssize_t nwritten = send(in->fd, p, nread, MSG_NOSIGNAL);
+            if (nwritten < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nwritten < 0) {
+                break;
+            }
+            p     += nwritten;
+            nread -= nwritten;
+        }
+        if (nread > 0) {
+            break;
+        }
+    }
+
+    shutdown(in->fd, SHUT_WR);
+    __atomic_store_n(&in->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Stop forwarding request body to CGI script (once its output has been
+ * relayed) and close the script's input.
+ *
+ * If the body has not been forwarded completely, the forwarding thread is
+ * woken from reading the client or writing to the script by shutting both
+ * down, so it never outlives the request.
+ **/
+static void
+cgi_input_finish(struct cgi_input *in)
+{
+    if (in->fd < 0) {
+        return;
+    }
+
+    if (!__atomic_load_n(&in->done, __ATOMIC_ACQUIRE)) {
+        shutdown(in->r->fd, SHUT_RD);
+        shutdown(in->fd, SHUT_RDWR);
+    }
+    pthread_join(in->thread, NULL);
+    close(in->fd);
+    in->fd = -1;
+}
+
+/**
+ * Spawn CGI script for request with its output connected to a pipe.
+ *
+ * The script is executed directly with posix_spawn (no shell in between) and
+ * the request-local environment from cgi_environment, so nothing in the
+ * server process is modified and this is safe from any thread.  SIGPIPE,
+ * which the server ignores, is reset to its default action for the script,
+ * and no signals are blocked (the server blocks SIGHUP for snapshot reloads).
+ *
+ * If the request has a body (of length bytes), it is forwarded to the
+ * script's standard input by a thread (see cgi_pump) while the output is
+ * read, and cgi_input_finish must be called with input once the script has
+ * exited.  The input is a socket, so a script that exits without reading it
+ * cannot raise SIGPIPE.  Otherwise its standard input is /dev/null.
+ *
+ * Returns the read end of the pipe (and sets pid) on success, -1 on error.
+ **/
+static int
+cgi_spawn(struct request *r, size_t length, struct cgi_input *input, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t defaults;
+    sigset_t mask;
+    char  *argv[] = {r->path, NULL};
+    char **envp;
+    int    fds[2];
+    int    stdin_fds[2] = {-1, -1};
+    int    status;
+
+    input->r         = r;
+    input->fd        = -1;
+    input->remaining = length;
+    input->done      = false;
+
+    if ((envp = cgi_environment(r)) == NULL) {
+        return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        free(envp);
+        return -1;
+    }
+    if (length > 0 && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, stdin_fds) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        free(envp);
+        return -1;
+    }
+    if (length > 0) {
+        input->fd = stdin_fds[0];
+        if ((status = pthread_create(&input->thread, NULL, cgi_pump, input)) != 0) {
+            close(stdin_fds[0]);
+            close(stdin_fds[1]);
+            close(fds[0]);
+            close(fds[1]);
+            free(envp);
+            input->fd = -1;
+            errno = status;
+            return -1;
+        }
+    }
+    fcntl(fds[0], F_SETPIPE_SZ, CGI_PIPE_SIZE);  /* Fewer, larger splices (best effort) */
+
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_fds[1] >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, stdin_fds[1], STDIN_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setsigmask(&attributes, &mask);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    status = posix_spawn(pid, r->path, &actions, &attributes, argv, envp);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    free(envp);
+    close(fds[1]);
+    if (stdin_fds[1] >= 0) {
+        close(stdin_fds[1]);
+    }
+
+    if (status != 0) {
+        cgi_input_finish(input);
+        close(fds[0]);
+        errno = status;
+        return -1;
+    }
+    return fds[0];
+}
+
+/* CGI output captured for the response cache */
+struct cgi_capture {
+    char	   *data;		/* Captured output (NULL if not capturing) */
+    size_t	    length;		/* Bytes captured */
+    size_t	    capacity;		/* Bytes allocated */
+    struct flight  *flight;		/* Flight waiting for the output (or NULL) */
+};
+
+/* Scripts with a response cache TTL (--cgi-cache) */
+static struct {
+    char	   *key;		/* Script path relative to RootPath */
+    time_t	    ttl;		/* Seconds responses may be cached */
+} CgiCacheRules[CGI_CACHE_RULES_MAX];
+static size_t	    CgiCacheRulesCount = 0;
+
+/**
+ * Read from CGI pipe (retrying if interrupted).
+ *
+ * Returns number of bytes read, 0 at end of output, -1 on error.
+ **/
+static ssize_t
+cgi_read(int fd, char *buffer, size_t n)
+{
+    ssize_t nread;
+
+    while ((nread = read(fd, buffer, n)) < 0 && errno == EINTR) {
+        continue;
+    }
+    return nread;
+}
+
+/**
+ * Determine content coding for CGI response from the start of its output in
+ * buffer (the header block of length head followed by some of the body, with
+ * more to come if more is set).
+ *
+ * The body is compressed with coding (as accepted by the client) only if it
+ * is not tiny, the script declared a compressible Content-Type, and did not
+ * encode the body itself.
+ *
+ * Returns coding, or NULL if the body is to be relayed as is.
+ **/
+static const char *
+cgi_coding(const char *buffer, size_t length, size_t head, const char *coding, bool more)
+{
+    char mimetype[BUFSIZ];
+    const char *type;
+    size_t n;
+
+    if (coding == NULL || head == 0 || (length - head < COMPRESS_MIN && !more)) {
+        return NULL;
+    }
+
+    type = cgi_head_value(buffer, head, "Content-Type", &n);
+    snprintf(mimetype, sizeof(mimetype), "%.*s", type ? (int)n : 0, type ? type : "");
+    if (!type || cgi_head_value(buffer, head, "Content-Encoding", &n) || !compress_type(mimetype)) {
+        return NULL;
+    }
+    return coding;
+}
+
+/**
+ * Append CGI output to capture for the response cache.  Capturing stops (and
+ * the data is dropped) once the output is too large to be cached, and the
+ * requests following this one are then released right away to run the
+ * script themselves, rather than waiting for output they will not get.
+ **/
+static void
+cgi_capture(struct cgi_capture *c, const char *data, size_t n)
+{
+    if (c == NULL || c->data == NULL) {
+        return;
+    }
+
+    if (!cache_fits(c->length + n)) {
+        free(c->data);
+        c->data = NULL;
+        flight_finish(c->flight, NULL, 0);
+        c->flight = NULL;
+        return;
+    }
+    if (c->length + n > c->capacity) {
+        char *data;
+
+        c->capacity = c->length + n > 2 * c->capacity ? c->length + n : 2 * c->capacity;
+        if ((data = realloc(c->data, c->capacity)) == NULL) {
+            free(c->data);
+            c->data = NULL;
+            flight_finish(c->flight, NULL, 0);
+            c->flight = NULL;
+            return;
+        }
+        c->data = data;
+    }
+    memcpy(c->data + c->length, data, n);
+    c->length += n;
+}
+
+/**
+ * Relay CGI output to socket: first the start of the output in data (the
+ * header block of length head and some of the body), then the rest from the
+ * script's pipe (unless fd is -1).
+ *
+ * The body is compressed with coding (unless it is NULL), and the output is
+ * also captured for the response cache (unless capture is NULL).  Otherwise,
+ * only the start of the output passes through user space and the rest is
+ * spliced from the pipe to the socket.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+cgi_relay(struct request *r, const char *coding, const char *data, size_t length, size_t head, int fd, struct cgi_capture *capture)
+{
+    struct compressor z;
     char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
+    ssize_t nread;
+    int status;
 
-    /* Open file for reading */
+    if (coding && compress_start(&z, &r->conn, coding) < 0) {
+        coding = NULL;
+    }
 
-    /* Determine mimetype */
+    if (coding) {
+        cgi_write_compressed_head(r, data, head, coding);
+        status = compress_write(&z, data + head, length - head);
+    } else {
+        status = conn_write(&r->conn, data, length);
+    }
+    cgi_capture(capture, data, length);
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
+    /* Relay the rest: an uncompressed body that is not (or no longer) being
+     * captured is spliced straight from the pipe to the socket (see
+     * conn_sendfile), otherwise it is copied through user space */
+    while (status == 0 && fd >= 0) {
+        if (!coding && (capture == NULL || capture->data == NULL)) {
+            if ((nread = conn_sendfile(&r->conn, fd, NULL, CGI_SPLICE_MAX)) < 0) {
+                if (errno == EAGAIN && conn_wait(&r->conn, POLLOUT) == 0) {
+                    continue;
+                }
+                status = -1;
+            }
+            if (nread <= 0) {
+                break;
+            }
+            continue;
+        }
 
-    /* Read from file and write to socket in chunks */
+        if ((nread = cgi_read(fd, buffer, sizeof(buffer))) <= 0) {
+            status = nread < 0 ? -1 : 0;
+            break;
+        }
+        status = coding ? compress_write(&z, buffer, nread) : conn_write(&r->conn, buffer, nread);
+        cgi_capture(capture, buffer, nread);
+    }
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    return HTTP_STATUS_OK;
+    if (coding && compress_finish(&z) < 0) {
+        status = -1;
+    }
+    return status;
 }
 
 /**
- * Handle file request
+ * Configure CGI response cache for script from specification "uri:ttl"
+ * (e.g. "/scripts/cowsay.sh:60").
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * Returns 0 on success, -1 on error.
+ **/
+int
+cgi_cache_configure(const char *spec)
+{
+    char uri[PATH_MAX];
+    char key[PATH_MAX];
+    char *colon;
+    char *end;
+    long ttl;
+
+    if (CgiCacheRulesCount == CGI_CACHE_RULES_MAX) {
+        fprintf(stderr, "Too many CGI cache rules\n");
+        return -1;
+    }
+
+    snprintf(uri, sizeof(uri), "%s", spec);
+    if ((colon = strrchr(uri, ':')) == NULL) {
+        return -1;
+    }
+    *colon++ = '\0';
+
+    ttl = strtol(colon, &end, 10);
+    if (ttl <= 0 || *end != '\0' || normalize_uri(uri, key, sizeof(key)) < 0) {
+        return -1;
+    }
+    if ((CgiCacheRules[CgiCacheRulesCount].key = strdup(key)) == NULL) {
+        return -1;
+    }
+    CgiCacheRules[CgiCacheRulesCount++].ttl = ttl;
+    return 0;
+}
+
+/**
+ * Build CGI response cache key for request: the resolved path, the query
+ * string, and the values of the headers listed in CgiCacheVary.
+ *
+ * Only GET requests without a body or credentials are cacheable.
+ *
+ * Returns true if the request is cacheable (and key was built), false
+ * otherwise.
+ **/
+static bool
+cgi_cache_key(struct request *r, char *key, size_t n)
+{
+    char vary[BUFSIZ];
+    char *name;
+    char *state;
+    size_t length;
+
+    if (CacheSize == 0 || !streq(r->method, "GET") ||
+        request_header(r, "Content-Length") || request_header(r, "Authorization")) {
+        return false;
+    }
+
+    length = snprintf(key, n, "%s?%s;cgi", r->path, r->query ? r->query : "");
+    snprintf(vary, sizeof(vary), "%s", CgiCacheVary ? CgiCacheVary : "");
+    for (name = strtok_r(vary, ", ", &state); name && length < n; name = strtok_r(NULL, ", ", &state)) {
+        const char *value = request_header(r, name);
+        length += snprintf(key + length, n - length, ";%s=%s", name, value ? value : "");
+    }
+    return length < n;
+}
+
+/**
+ * Return TTL configured for the requested CGI script with --cgi-cache, or 0
+ * if there is none.
+ **/
+static time_t
+cgi_cache_rule(struct request *r)
+{
+    for (size_t i = 0; i < CgiCacheRulesCount; i++) {
+        if (streq(CgiCacheRules[i].key, r->file->key)) {
+            return CgiCacheRules[i].ttl;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Build key for coalescing identical CGI requests in flight (see flight_join)
+ * from the request's cache key.
+ *
+ * Only scripts configured with --cgi-cache are declared by the operator to
+ * vary by nothing but the cache key, so only their requests are coalesced on
+ * it.  For any other script, the key also holds the client address and every
+ * request header, since they all reach the script's environment (e.g. a
+ * Cookie), so only requests the script cannot tell apart are coalesced.
+ *
+ * Returns true if key was built, false otherwise.
+ **/
+static bool
+cgi_flight_key(struct request *r, const char *cache_key, char *key, size_t n)
+{
+    size_t length = snprintf(key, n, "%s", cache_key);
+
+    if (cgi_cache_rule(r) > 0 || length >= n) {
+        return length < n;
+    }
+
+    length += snprintf(key + length, n - length, ";addr=%s", r->host);
+    for (struct header *header = r->headers; header && length < n; header = header->next) {
+        length += snprintf(key + length, n - length, ";%s=%s", header->name, header->value);
+    }
+    return length < n;
+}
+
+/**
+ * Return whether CGI response is private to its request, i.e. it sets cookies
+ * or is marked private or no-store, so it must be neither cached nor shared
+ * with other requests.
+ **/
+static bool
+cgi_private(const char *head, size_t n)
+{
+    char control[BUFSIZ];
+    char *directive;
+    char *state;
+    const char *value;
+    size_t length;
+
+    if (cgi_head_value(head, n, "Set-Cookie", &length)) {
+        return true;
+    }
+    if ((value = cgi_head_value(head, n, "Cache-Control", &length))) {
+        snprintf(control, sizeof(control), "%.*s", (int)length, value);
+        for (directive = strtok_r(control, ", ", &state); directive; directive = strtok_r(NULL, ", ", &state)) {
+            if (strcasecmp(directive, "private") == 0 || strcasecmp(directive, "no-store") == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Determine how long CGI response may be cached from its header block.
+ *
+ * A Cache-Control max-age (or s-maxage) sent by the script takes precedence
+ * over the TTL configured for the script with --cgi-cache.  Private responses
+ * (see cgi_private), ones marked no-cache, and ones with a status other than
+ * 200 are never cached.
+ *
+ * Returns TTL in seconds, or 0 if the response must not be cached.
+ **/
+static time_t
+cgi_cache_ttl(struct request *r, const char *head, size_t n)
+{
+    char control[BUFSIZ];
+    char *directive;
+    char *state;
+    const char *value;
+    size_t length;
+    time_t ttl = 0;
+    time_t shared = -1;
+
+    /* Status (from an NPH status line or the Status header) */
+    if (strncmp(head, "HTTP/", 5) == 0) {
+        value = skip_whitespace(skip_nonwhitespace((char *)head));
+    } else {
+        value = cgi_head_value(head, n, "Status", &length);
+    }
+    if ((value && atoi(value) != 200) || cgi_private(head, n)) {
+        return 0;
+    }
+
+    ttl = cgi_cache_rule(r);
+    if ((value = cgi_head_value(head, n, "Cache-Control", &length))) {
+        snprintf(control, sizeof(control), "%.*s", (int)length, value);
+        for (directive = strtok_r(control, ", ", &state); directive; directive = strtok_r(NULL, ", ", &state)) {
+            if (strcasecmp(directive, "no-cache") == 0) {
+                return 0;
+            } else if (strncasecmp(directive, "max-age=", 8) == 0) {
+                ttl = strtol(directive + 8, NULL, 10);
+            } else if (strncasecmp(directive, "s-maxage=", 9) == 0) {
+                shared = strtol(directive + 9, NULL, 10);
+            }
+        }
+    }
+    ttl = shared >= 0 ? shared : ttl;
+    return ttl > 0 ? ttl : 0;
+}
+
+/**
+ * Replay complete CGI output (e.g. from the response cache) to socket.
+ **/
+static void
+cgi_replay(struct request *r, const char *data, size_t length, const char *coding)
+{
+    size_t head = cgi_head_length(data, length);
+
+    cgi_relay(r, cgi_coding(data, length, head, coding, false), data, length, head, -1, NULL);
+    conn_flush(&r->conn);
+}
+
+/**
+ * Handle CGI request
  *
+ * This spawns the specified executable (see cgi_spawn) and streams its results
+ * to the socket.  If the client accepts it, the body is compressed on the fly (unless
+ * it is tiny, of an already compressed type, or encoded by the script).
+ * Scripts configured with --fastcgi are instead handed to their persistent
+ * worker pool (see fastcgi_handle).
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * Responses that may be cached (see cgi_cache_ttl) are kept in the hot file
+ * cache under the request's cache key (see cgi_cache_key) until they expire
+ * or the script changes, and hits are served without spawning the script.
+ * Identical requests that miss while the script is already running for one
+ * of them wait for it and receive its output (see flight_join and
+ * cgi_flight_key), unless the response turns out to be private.
+ *
+ * If the Content-Length is malformed, then handle error with
+ * HTTP_STATUS_BAD_REQUEST.  If the path cannot be spawned, then handle error
+ * with HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 http_status
 handle_cgi_request(struct request *r)
 {
-    FILE *pfs;
     char buffer[BUFSIZ];
-    struct header *header;
+    char key[BUFSIZ];
+    char flight_key[BUFSIZ];
+    struct cache_entry *entry;
+    struct cgi_capture capture = {NULL, 0, 0, NULL};
+    const char *coding = compress_coding(request_header(r, "Accept-Encoding"));
+    bool cacheable;
+    size_t length = 0;
+    size_t head = 0;
+    ssize_t nread;
+    time_t ttl = 0;
+    int status;
+    int fd;
+    int exit_status = -1;
+    pid_t pid;
+    struct fastcgi_pool *pool;
+    struct limiter_script *slot;
+    struct flight *flight = NULL;
+    struct cgi_input input;
+    size_t body;
+    bool leader;
+
+    if ((pool = fastcgi_lookup(r->file->key))) {
+        return fastcgi_handle(pool, r);
+    }
+    if (request_content_length(r, &body) < 0) {
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    }
+
+    /* Serve cached response (without spawning the script) */
+    cacheable = cgi_cache_key(r, key, sizeof(key));
+    if (cacheable && (entry = cache_lookup(key, &r->st))) {
+        cgi_replay(r, entry->data, entry->length, coding);
+        cache_release(entry);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Follow identical request in progress and serve its output (from the
+     * cache or shared by the leader); if it has none, run the script */
+    if (cacheable && cgi_flight_key(r, key, flight_key, sizeof(flight_key)) &&
+        (flight = flight_join(flight_key, &leader)) && !leader) {
+        const char *data = NULL;
+
+        if ((entry = cache_lookup(key, &r->st))) {
+            cgi_replay(r, entry->data, entry->length, coding);
+        } else if ((data = flight_result(flight, &length))) {
+            cgi_replay(r, data, length, coding);
+        }
+        cache_release(entry);
+        flight_release(flight);
+        if (entry || data) {
+            return HTTP_STATUS_OK;
+        }
+        flight = NULL;
+        length = 0;
+    }
 
-    /* Export CGI environment variables from request:
-    * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
+    /* Wait for a slot (see limiter_acquire), then spawn CGI Script */
+    if ((slot = limiter_acquire(r->file->key)) == NULL && errno != ENOSYS) {
+        debug("Unable to run %s: %s", r->path, errno == EAGAIN ? "queue full" : "queue timeout");
+        flight_finish(flight, NULL, 0);
+        return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+    }
+    if ((fd = cgi_spawn(r, body, &input, &pid)) < 0) {
+        debug("Unable to spawn %s: %s", r->path, strerror(errno));
+        limiter_release(slot);
+        flight_finish(flight, NULL, 0);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
 
-    /* Export CGI environment variables from request headers */
+    /* Read header block and the start of the body (enough to tell whether
+     * compressing it is worthwhile), releasing the requests following this
+     * one as soon as the header block shows the response is private */
+    while (length < sizeof(buffer) && (nread = cgi_read(fd, buffer + length, sizeof(buffer) - length)) > 0) {
+        length += nread;
+        if ((head = cgi_head_length(buffer, length)) && flight && cgi_private(buffer, head)) {
+            flight_finish(flight, NULL, 0);
+            flight = NULL;
+        }
+        if (head && length - head >= COMPRESS_MIN) {
+            break;
+        }
+    }
+    if (head == 0) {
+        head = cgi_head_length(buffer, length);
+    }
 
-    /* POpen CGI Script */
+    /* Capture response for cache (if the script allows it) or for requests
+     * following this one (unless it is private) */
+    if (cacheable && head && ((ttl = cgi_cache_ttl(r, buffer, head)) > 0 || (flight && !cgi_private(buffer, head)))) {
+        capture.capacity = sizeof(buffer);
+        capture.data     = malloc(capture.capacity);
+    }
 
+    /* Release the requests following this one right away if there is no
+     * output to share with them (e.g. it is private), so they run the script
+     * in parallel instead of waiting for this one to finish */
+    if (capture.data == NULL) {
+        flight_finish(flight, NULL, 0);
+    } else {
+        capture.flight = flight;
+    }
 
-    /* Copy data from popen to socket */
+    /* Copy data from pipe to socket */
+    status = cgi_relay(r, cgi_coding(buffer, length, head, coding, length == sizeof(buffer)), buffer, length, head, fd, &capture);
 
-    /* Close popen, flush socket, return OK */
+    /* Close pipe, reap script, stop forwarding its input, release slot */
+    close(fd);
+    while (waitpid(pid, &exit_status, 0) < 0 && errno == EINTR) {
+        continue;
+    }
+    cgi_input_finish(&input);
+    limiter_release(slot);
+
+    /* Cache complete output of successful script, or share it with the
+     * requests following this one */
+    if (capture.data && status == 0 && WIFEXITED(exit_status) && WEXITSTATUS(exit_status) == 0) {
+        if (ttl > 0) {
+            cache_release(cache_insert_data(key, &r->st, capture.data, capture.length, NULL, time(NULL) + ttl));
+            capture.data = NULL;
+        }
+    } else {
+        free(capture.data);
+        capture.data = NULL;
+    }
+    flight_finish(capture.flight, capture.data, capture.length);
+
+    /* Flush socket, return OK */
+    conn_flush(&r->conn);
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Handle server status request
+ *
+ * This writes the statistics of the server's caches as plain text, one
+ * "name value" pair per line.
+ **/
+http_status
+handle_status_request(struct request *r)
+{
+    struct head h;
+    char head[BUFSIZ];
+
+    head_start(&h, head, sizeof(head), HTTP_STATUS_OK, 10);
+    head_add(&h, HEADER_CONTENT_TYPE, "text/plain");
+    head_write(&h, &r->conn);
+
+    cache_write_status(&r->conn);
+    fdcache_write_status(&r->conn);
+    fastcgi_write_status(&r->conn);
+    limiter_write_status(&r->conn);
+    flight_write_status(&r->conn);
+    snapshot_write_status(&r->conn);
+
+    conn_flush(&r->conn);
+    return HTTP_STATUS_OK;
+}
+
+/* Prepared error responses (see handler_start), by status and HTTP/1.x */
+struct error_response {
+    char	    data[ERROR_RESPONSE_MAX];
+    size_t	    length;
+    size_t	    date;		/* Offset of Date value */
+};
+
+static struct error_response ErrorResponses[HTTP_STATUS_MAX][2];
+
+/**
+ * Prepare request handlers.
+ *
+ * This serializes the complete error response (status line, headers, and HTML
+ * body) for every status and HTTP version once, so that handle_error only has
+ * to write it out with the current Date spliced in.
+ **/
+void
+handler_start(void)
+{
+    for (http_status status = 0; status < HTTP_STATUS_MAX; status++) {
+        const char *status_string = http_status_string(status);
+        char body[ERROR_RESPONSE_MAX];
+        int  length = 0;
+
+        if (status != HTTP_STATUS_NOT_MODIFIED) {
+            length = snprintf(body, sizeof(body), "<h1>%s</h1>\n<p>Spidey could not handle your request.</p>\n", status_string);
+        }
+
+        for (int version = 0; version < 2; version++) {
+            struct error_response *e = &ErrorResponses[status][version];
+            struct head h;
+
+            head_start(&h, e->data, sizeof(e->data), status, 10 + version);
+            head_add(&h, HEADER_CONTENT_TYPE, "text/html");
+            head_add_number(&h, HEADER_CONTENT_LENGTH, length);
+            head_add(&h, HEADER_CONNECTION, "close");
+            head_finish(&h);
+            head_append(&h, body, length);
+            e->length = h.length < sizeof(e->data) ? h.length : sizeof(e->data);
+            e->date   = h.date;
+        }
+    }
+}
+
 /**
  * Handle displaying error page
  *
- * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * This writes the HTTP status error code and an HTML message to notify the
+ * user of the error, using the response prepared by handler_start for the
+ * status and the request's HTTP version in a single write.
  **/
 http_status
 handle_error(struct request *r, http_status status)
 {
-    const char *status_string = http_status_string(status);
+    struct error_response *e;
+    char date[DATE_MAX];
 
-    /* Write HTTP Header */
+    if ((unsigned)status >= HTTP_STATUS_MAX) {
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    e = &ErrorResponses[status][r->version >= 11];
 
-    /* Write HTML Description of Error*/
+    /* Write prepared response with current Date, return specified status */
+    struct iovec iov[3] = {
+        {e->data, e->date},
+        {date, DATE_LENGTH},
+        {e->data + e->date + DATE_LENGTH, e->length - e->date - DATE_LENGTH},
+    };
 
-    /* Return specified status */
+    format_http_now(date, sizeof(date));
+    conn_writev(&r->conn, iov, 3);
     return status;
 }
 
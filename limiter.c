@@ -0,0 +1,369 @@
+/* limiter.c: CGI Concurrency Limiter */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define LIMITER_SCRIPTS	    256			/* Scripts tracked (hash table slots) */
+#define LIMITER_WAITERS	    1024		/* Requests that may wait at once */
+#define LIMITER_KEY_MAX	    128			/* Longest script key stored */
+#define LIMITER_NONE	    ((size_t)-1)	/* End of waiter list */
+
+/* Internal Structures */
+
+struct limiter_waiter {
+    pthread_cond_t  cond;		/* Signalled when admitted */
+    bool	    admitted;		/* Slot granted by scheduler */
+    size_t	    next;		/* Next waiter (queue or free list) */
+};
+
+struct limiter_script {
+    char	    key[LIMITER_KEY_MAX];/* Script path relative to RootPath */
+    size_t	    hash;		/* Hash of full key (0 if slot unused) */
+    size_t	    running;		/* Requests running */
+    size_t	    head;		/* FIFO queue of waiters */
+    size_t	    tail;
+    size_t	    waiting;		/* Length of queue */
+    size_t	    admitted;		/* Statistics: requests admitted, */
+    size_t	    rejected;		/*   rejected (queue full), */
+    size_t	    timeouts;		/*   timed out while queued, */
+    uint64_t	    wait_total;		/*   total and longest queue wait */
+    uint64_t	    wait_max;		/*   (microseconds) */
+};
+
+struct limiter {			/* Shared by all server processes */
+    pthread_mutex_t	  lock;
+    size_t		  running;	/* Requests running (all scripts) */
+    size_t		  waiting;	/* Requests queued (all scripts) */
+    size_t		  cursor;	/* Round-robin scheduling position */
+    size_t		  free;		/* Free waiter slots */
+    struct limiter_script scripts[LIMITER_SCRIPTS];
+    struct limiter_waiter waiters[LIMITER_WAITERS];
+};
+
+/* Internal Variables */
+
+static struct limiter *Limiter = NULL;
+
+/* Internal Functions */
+
+/**
+ * Hash key (FNV-1a, never 0).
+ **/
+static size_t
+limiter_hash(const char *key)
+{
+    size_t hash = 2166136261u;
+
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Find (or claim) slot for script key (must hold lock).
+ *
+ * Once the table is full, new scripts share the slot they hash to.
+ **/
+static struct limiter_script *
+limiter_script(const char *key)
+{
+    size_t hash = limiter_hash(key);
+
+    for (size_t n = 0; n < LIMITER_SCRIPTS; n++) {
+        struct limiter_script *s = &Limiter->scripts[(hash + n) % LIMITER_SCRIPTS];
+
+        if (s->hash == 0) {
+            s->hash = hash;
+            s->head = s->tail = LIMITER_NONE;
+            snprintf(s->key, sizeof(s->key), "%s", key);
+            return s;
+        }
+        if (s->hash == hash && strncmp(s->key, key, sizeof(s->key) - 1) == 0) {
+            return s;
+        }
+    }
+    return &Limiter->scripts[hash % LIMITER_SCRIPTS];
+}
+
+/**
+ * Return whether script may start another request now.
+ **/
+static bool
+limiter_available(const struct limiter_script *s)
+{
+    return (CgiMax == 0 || Limiter->running < CgiMax) &&
+           (CgiMaxPerScript == 0 || s->running < CgiMaxPerScript);
+}
+
+/**
+ * Admit queued requests while there is capacity (must hold lock).
+ *
+ * Scripts are visited round-robin, admitting one request from each in turn,
+ * so that a script with a long queue cannot take every slot that frees up:
+ * each queue is FIFO, and every script with waiters gets its turn.
+ **/
+static void
+limiter_schedule(void)
+{
+    size_t idle = 0;
+
+    while (Limiter->waiting > 0 && idle < LIMITER_SCRIPTS) {
+        struct limiter_script *s = &Limiter->scripts[Limiter->cursor];
+        struct limiter_waiter *w;
+
+        Limiter->cursor = (Limiter->cursor + 1) % LIMITER_SCRIPTS;
+        if (s->waiting == 0 || !limiter_available(s)) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+
+        /* Admit head of queue */
+        w = &Limiter->waiters[s->head];
+        s->head = w->next;
+        if (s->head == LIMITER_NONE) {
+            s->tail = LIMITER_NONE;
+        }
+        s->waiting--;
+        Limiter->waiting--;
+        s->running++;
+        Limiter->running++;
+        w->admitted = true;
+        pthread_cond_signal(&w->cond);
+    }
+}
+
+/**
+ * Remove waiter from script's queue (must hold lock).
+ **/
+static void
+limiter_dequeue(struct limiter_script *s, size_t index)
+{
+    size_t *p = &s->head;
+    size_t  previous = LIMITER_NONE;
+
+    while (*p != index) {
+        previous = *p;
+        p = &Limiter->waiters[*p].next;
+    }
+    *p = Limiter->waiters[index].next;
+    if (s->tail == index) {
+        s->tail = previous;
+    }
+    s->waiting--;
+    Limiter->waiting--;
+}
+
+/**
+ * Return microseconds elapsed since start (monotonic clock).
+ **/
+static uint64_t
+limiter_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000ULL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Functions */
+
+/**
+ * Start CGI concurrency limiter.
+ *
+ * The limiter state lives in shared memory with process-shared locks, so that
+ * the limits apply across all server processes (e.g. in forking mode).  Must
+ * be called before any server process or thread is started.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+limiter_start(void)
+{
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t  cattr;
+
+    Limiter = mmap(NULL, sizeof(struct limiter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Limiter == MAP_FAILED) {
+        fprintf(stderr, "Unable to map CGI limiter: %s\n", strerror(errno));
+        Limiter = NULL;
+        return -1;
+    }
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&Limiter->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    for (size_t i = 0; i < LIMITER_WAITERS; i++) {
+        pthread_cond_init(&Limiter->waiters[i].cond, &cattr);
+        Limiter->waiters[i].next = i + 1 < LIMITER_WAITERS ? i + 1 : LIMITER_NONE;
+    }
+    pthread_condattr_destroy(&cattr);
+    Limiter->free = 0;
+
+    debug("CGI limits: %zu running, %zu per script, %zu queued per script, %zus timeout",
+        CgiMax, CgiMaxPerScript, CgiQueueMax, CgiQueueTimeout);
+    return 0;
+}
+
+/**
+ * Acquire slot to run CGI script (path relative to RootPath).
+ *
+ * If the global (CgiMax) or per-script (CgiMaxPerScript) limit is reached,
+ * the request waits in the script's FIFO queue for up to CgiQueueTimeout
+ * seconds.  Requests are rejected right away if the queue already holds
+ * CgiQueueMax requests.
+ *
+ * Returns slot to pass to limiter_release on success, NULL if the request was
+ * rejected or timed out (errno is EAGAIN or ETIMEDOUT), or if the limiter is
+ * not running (errno is ENOSYS).
+ **/
+struct limiter_script *
+limiter_acquire(const char *key)
+{
+    struct limiter_script *s;
+    struct limiter_waiter *w;
+    struct timespec start;
+    struct timespec deadline;
+    size_t index;
+    uint64_t waited;
+
+    if (Limiter == NULL) {
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&Limiter->lock);
+    s = limiter_script(key);
+
+    /* Run right away if nobody is ahead in line */
+    if (s->waiting == 0 && limiter_available(s)) {
+        s->running++;
+        Limiter->running++;
+        s->admitted++;
+        pthread_mutex_unlock(&Limiter->lock);
+        return s;
+    }
+
+    /* Reject if queue is full */
+    if (s->waiting >= CgiQueueMax || Limiter->free == LIMITER_NONE) {
+        s->rejected++;
+        pthread_mutex_unlock(&Limiter->lock);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    /* Wait in line */
+    index = Limiter->free;
+    w = &Limiter->waiters[index];
+    Limiter->free = w->next;
+    w->admitted = false;
+    w->next = LIMITER_NONE;
+    if (s->tail == LIMITER_NONE) {
+        s->head = index;
+    } else {
+        Limiter->waiters[s->tail].next = index;
+    }
+    s->tail = index;
+    s->waiting++;
+    Limiter->waiting++;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += CgiQueueTimeout;
+    while (!w->admitted) {
+        if (pthread_cond_timedwait(&w->cond, &Limiter->lock, &deadline) == ETIMEDOUT && !w->admitted) {
+            break;
+        }
+    }
+
+    waited = limiter_elapsed(&start);
+    s->wait_total += waited;
+    s->wait_max    = waited > s->wait_max ? waited : s->wait_max;
+    if (!w->admitted) {
+        limiter_dequeue(s, index);
+        s->timeouts++;
+        s = NULL;
+    } else {
+        s->admitted++;
+    }
+    w->next = Limiter->free;
+    Limiter->free = index;
+
+    pthread_mutex_unlock(&Limiter->lock);
+    if (s == NULL) {
+        errno = ETIMEDOUT;
+    }
+    return s;
+}
+
+/**
+ * Release slot acquired with limiter_acquire, admitting queued requests.
+ **/
+void
+limiter_release(struct limiter_script *s)
+{
+    if (s == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&Limiter->lock);
+    s->running--;
+    Limiter->running--;
+    limiter_schedule();
+    pthread_mutex_unlock(&Limiter->lock);
+}
+
+/**
+ * Write CGI limiter statistics to connection as plain text.
+ **/
+void
+limiter_write_status(struct conn *c)
+{
+    struct limiter_script scripts[LIMITER_SCRIPTS];
+    size_t running;
+    size_t waiting;
+
+    if (Limiter == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&Limiter->lock);
+    running = Limiter->running;
+    waiting = Limiter->waiting;
+    memcpy(scripts, Limiter->scripts, sizeof(scripts));
+    pthread_mutex_unlock(&Limiter->lock);
+
+    conn_printf(c, "cgi.running %zu\n", running);
+    conn_printf(c, "cgi.queued %zu\n", waiting);
+    for (size_t i = 0; i < LIMITER_SCRIPTS; i++) {
+        struct limiter_script *s = &scripts[i];
+        size_t waits = s->admitted + s->timeouts;
+
+        if (s->hash == 0) {
+            continue;
+        }
+        conn_printf(c, "cgi.%s.running %zu\n", s->key, s->running);
+        conn_printf(c, "cgi.%s.queued %zu\n", s->key, s->waiting);
+        conn_printf(c, "cgi.%s.admitted %zu\n", s->key, s->admitted);
+        conn_printf(c, "cgi.%s.rejected %zu\n", s->key, s->rejected);
+        conn_printf(c, "cgi.%s.timeouts %zu\n", s->key, s->timeouts);
+        conn_printf(c, "cgi.%s.wait_avg_us %llu\n", s->key, waits ? (unsigned long long)(s->wait_total / waits) : 0ULL);
+        conn_printf(c, "cgi.%s.wait_max_us %llu\n", s->key, (unsigned long long)s->wait_max);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
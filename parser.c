@@ -0,0 +1,347 @@
+/* parser.c: Incremental HTTP Request Parser */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Constants */
+
+#define PARSER_LINE_INITIAL	256	/* Initial line buffer capacity */
+
+/* Internal Declarations */
+
+static int parser_limit(struct parser *p, size_t n);
+static int parser_append(struct parser *p, const char *data, size_t n);
+static int parser_request_line(struct parser *p, struct request *r, char *line);
+static int parser_header_line(struct parser *p, struct request *r, char *line);
+
+/**
+ * Feed bytes to HTTP request parser.
+ *
+ * The parser may be fed arbitrary chunks of the request (down to a single
+ * byte at a time).  Bytes are accumulated into the current line and only the
+ * newly fed bytes are ever scanned for the end of line, so consumed input is
+ * never rescanned.  Lines may end in either CRLF or a bare LF, and the CR and
+ * LF may arrive in separate chunks.
+ *
+ * As complete lines arrive, the request method, uri, query, version, and
+ * headers are recorded in the request struct.
+ *
+ * The number of bytes consumed is stored in used; once the parser is done,
+ * any remaining bytes belong to the request body.
+ *
+ * Returns PARSE_NEED_MORE if the request head is incomplete, PARSE_DONE once
+ * the blank line terminating the headers has been seen, and PARSE_ERROR if
+ * the request is malformed or exceeds one of the configured limits (in which
+ * case the status to respond with is recorded in the parser).  Limits are
+ * checked before bytes are buffered, so an oversized request never grows the
+ * line buffer past its limit.
+ *
+ * A zeroed parser struct is ready to be fed; use parser_free to release it.
+ **/
+parse_status
+parser_feed(struct parser *p, struct request *r, const char *data, size_t n, size_t *used)
+{
+    size_t i = 0;
+
+    while (i < n && (p->state == PARSER_REQUEST_LINE || p->state == PARSER_HEADERS)) {
+        const char *newline = memchr(data + i, '\n', n - i);
+        size_t      chunk   = newline ? (size_t)(newline - (data + i)) : n - i;
+
+        if (parser_limit(p, chunk) < 0 || parser_append(p, data + i, chunk) < 0) {
+            p->state = PARSER_ERROR;
+            break;
+        }
+        i += chunk;
+
+        if (newline == NULL) {
+            break;
+        }
+        i++;
+
+        /* Complete line: strip CR (if any) and process */
+        if (p->state == PARSER_HEADERS || p->length <= 1) {
+            p->total += p->length + 1;
+        }
+        if (p->length > 0 && p->line[p->length - 1] == '\r') {
+            p->length--;
+        }
+        p->line[p->length] = '\0';
+        p->length = 0;
+
+        if (p->state == PARSER_REQUEST_LINE) {
+            if (parser_request_line(p, r, p->line) < 0) {
+                p->state = PARSER_ERROR;
+            }
+        } else {
+            if (parser_header_line(p, r, p->line) < 0) {
+                p->state = PARSER_ERROR;
+            }
+        }
+    }
+
+    if (used) {
+        *used = i;
+    }
+
+    if (p->state == PARSER_ERROR && p->status == HTTP_STATUS_OK) {
+        p->status = HTTP_STATUS_BAD_REQUEST;
+    }
+
+    switch (p->state) {
+        case PARSER_DONE:   return PARSE_DONE;
+        case PARSER_ERROR:  return PARSE_ERROR;
+        default:            return PARSE_NEED_MORE;
+    }
+}
+
+/**
+ * Release parser resources.
+ **/
+void
+parser_free(struct parser *p)
+{
+    free(p->line);
+    p->line     = NULL;
+    p->length   = 0;
+    p->capacity = 0;
+}
+
+/**
+ * Check whether n more bytes of the current line fit within the configured
+ * limits:
+ *
+ *  1. RequestLineMax:  Length of the request line (414 URI Too Long).
+ *  2. HeaderLineMax:   Length of a single header line (431).
+ *  3. HeaderBytesMax:  Total size of the header section (431).
+ *
+ * A limit of 0 disables the check.  Returns 0 if the bytes fit, otherwise
+ * records the error status and returns -1.
+ **/
+static int
+parser_limit(struct parser *p, size_t n)
+{
+    size_t length = p->length + n;
+
+    if (p->state == PARSER_REQUEST_LINE) {
+        if (RequestLineMax && length > RequestLineMax) {
+            p->status = HTTP_STATUS_URI_TOO_LONG;
+            return -1;
+        }
+        /* Empty lines before the request line count against the header
+         * section, so they cannot be streamed indefinitely */
+        if (HeaderBytesMax && p->total > HeaderBytesMax) {
+            p->status = HTTP_STATUS_BAD_REQUEST;
+            return -1;
+        }
+    } else {
+        if ((HeaderLineMax  && length > HeaderLineMax) ||
+            (HeaderBytesMax && p->total + length > HeaderBytesMax)) {
+            p->status = HTTP_STATUS_HEADERS_TOO_LARGE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Append bytes to current line, growing the line buffer as necessary (always
+ * leaving room for a terminating NUL).
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+parser_append(struct parser *p, const char *data, size_t n)
+{
+    if (p->length + n + 1 > p->capacity) {
+        size_t capacity = p->capacity ? p->capacity : PARSER_LINE_INITIAL;
+        char  *line;
+
+        while (p->length + n + 1 > capacity) {
+            capacity *= 2;
+        }
+        if ((line = realloc(p->line, capacity)) == NULL) {
+            fprintf(stderr, "parser_append: %s\n", strerror(errno));
+            return -1;
+        }
+        p->line     = line;
+        p->capacity = capacity;
+    }
+
+    memcpy(p->line + p->length, data, n);
+    p->length += n;
+    return 0;
+}
+
+/**
+ * Parse HTTP Request Line
+ *
+ * HTTP Requests come in the form
+ *
+ *  <METHOD> <URI>[QUERY] HTTP/<VERSION>
+ *
+ * Examples:
+ *
+ *  GET / HTTP/1.1
+ *  GET /cgi.script?q=foo HTTP/1.0
+ *
+ * This function extracts the method, uri, query (empty if it does not exist),
+ * and version.  Empty lines before the request line are ignored.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+parser_request_line(struct parser *p, struct request *r, char *line)
+{
+    char *method;
+    char *uri;
+    char *query;
+    char *version;
+    char *end;
+
+    /* Skip leading empty lines */
+    if ((method = skip_whitespace(line))[0] == '\0') {
+        return 0;
+    }
+
+    /* Split method, uri, and version */
+    end = skip_nonwhitespace(method);
+    if (*end) {
+        *end++ = '\0';
+    }
+    uri = skip_whitespace(end);
+    end = skip_nonwhitespace(uri);
+    if (*end) {
+        *end++ = '\0';
+    }
+    version = skip_whitespace(end);
+    end = skip_nonwhitespace(version);
+    if (*end) {
+        *end++ = '\0';
+    }
+
+    if (uri[0] == '\0' || skip_whitespace(end)[0] != '\0') {
+        debug("Malformed request line");
+        return -1;
+    }
+
+    /* Determine version (a missing version is treated as HTTP/1.0) */
+    if (version[0] == '\0' || streq(version, "HTTP/1.0")) {
+        r->version = 10;
+    } else if (streq(version, "HTTP/1.1")) {
+        r->version = 11;
+    } else {
+        debug("Unsupported version: %s", version);
+        return -1;
+    }
+
+    /* Split uri and query */
+    if ((query = strchr(uri, '?')) != NULL) {
+        *query++ = '\0';
+    } else {
+        query = "";
+    }
+
+    /* Record method, uri, and query in request struct */
+    if ((r->method = strdup(method)) == NULL ||
+        (r->uri    = strdup(uri))    == NULL ||
+        (r->query  = strdup(query))  == NULL) {
+        fprintf(stderr, "parser_request_line: %s\n", strerror(errno));
+        return -1;
+    }
+
+    p->state = PARSER_HEADERS;
+    return 0;
+}
+
+/**
+ * Parse HTTP Request Header Line
+ *
+ * HTTP Headers come in the form:
+ *
+ *  <NAME>: <VALUE>
+ *
+ * Each header is appended to the request's headers list.  Continuation lines
+ * (starting with whitespace) are folded into the previous header's value, and
+ * an empty line marks the end of the headers.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+static int
+parser_header_line(struct parser *p, struct request *r, char *line)
+{
+    struct header *header;
+    char *name;
+    char *value;
+    char *end;
+
+    /* End of headers */
+    if (line[0] == '\0') {
+        p->state = PARSER_DONE;
+        return 0;
+    }
+
+    /* Continuation of previous header */
+    if (line[0] == ' ' || line[0] == '\t') {
+        if (p->tail == NULL) {
+            return -1;
+        }
+
+        value = skip_whitespace(line);
+        for (end = value + strlen(value); end > value && strchr(WHITESPACE, end[-1]); end--);
+        *end = '\0';
+
+        size_t length = strlen(p->tail->value);
+        char  *folded = realloc(p->tail->value, length + 1 + strlen(value) + 1);
+        if (folded == NULL) {
+            fprintf(stderr, "parser_header_line: %s\n", strerror(errno));
+            return -1;
+        }
+        folded[length] = ' ';
+        strcpy(folded + length + 1, value);
+        p->tail->value = folded;
+        return 0;
+    }
+
+    /* Enforce header count */
+    if (HeaderCountMax && p->count >= HeaderCountMax) {
+        p->status = HTTP_STATUS_HEADERS_TOO_LARGE;
+        return -1;
+    }
+
+    /* Split name and value (no whitespace allowed before the colon) */
+    name = line;
+    if ((value = strchr(line, ':')) == NULL || value == name || strchr(WHITESPACE, value[-1])) {
+        debug("Malformed header: %s", line);
+        return -1;
+    }
+    *value++ = '\0';
+
+    value = skip_whitespace(value);
+    for (end = value + strlen(value); end > value && strchr(WHITESPACE, end[-1]); end--);
+    *end = '\0';
+
+    /* Append header */
+    if ((header = calloc(1, sizeof(struct header))) == NULL) {
+        fprintf(stderr, "parser_header_line: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((header->name = strdup(name)) == NULL || (header->value = strdup(value)) == NULL) {
+        fprintf(stderr, "parser_header_line: %s\n", strerror(errno));
+        free(header->name);
+        free(header);
+        return -1;
+    }
+
+    if (p->tail) {
+        p->tail->next = header;
+    } else {
+        r->headers = header;
+    }
+    p->tail = header;
+    p->count++;
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -7,9 +7,6 @@
 
 #include <unistd.h>
 
-int parse_request_method(struct request *r);
-int parse_request_headers(struct request *r);
-
 /**
  * Accept request from server socket.
  *
@@ -18,8 +15,8 @@ int parse_request_headers(struct request *r);
  *  1. Allocates a request struct initialized to 0.
  *  2. Initializes the headers list in the request struct.
  *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
+ *  4. Looks up the numeric client address and stores it in the request struct.
+ *  5. Initializes the client connection buffers for the request struct.
  *  6. Returns the request struct.
  *
  * The returned request struct must be deallocated using free_request.
@@ -28,9 +25,10 @@ struct request *
 accept_request(int sockfd)
 {
     struct request *req;
-    struct sockaddr raddr;
-    socklen_t rlen;
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
     size_t reqn = 1;
+    char name[NI_MAXHOST];
 
     /* Allocate request struct (zeroed) */
     req = (struct request *)calloc(reqn, sizeof(struct request));
@@ -39,25 +37,30 @@ accept_request(int sockfd)
         fprintf(stderr, "accept_request(): Memory allocation failed\n");
         return NULL;
     }
-    /* Accept a client */
-    if ((req->fd = accept(sockfd, &raddr, &rlen)) < 0)
+    req->fd = -1;
+    req->pathfd = -1;
+    /* Accept a client (close-on-exec, so CGI scripts do not inherit it) */
+    if ((req->fd = accept4(sockfd, (struct sockaddr *)&raddr, &rlen, SOCK_CLOEXEC)) < 0)
     {
-        fprintf(stderr, "Failed to accept request");
+        fprintf(stderr, "Failed to accept request: %s\n", strerror(errno));
         goto fail;
     }
-    /* Lookup client information */
-    if (getnameinfo(&raddr, rlen, req->host, sizeof(req->host), req->port, sizeof(req->port), 0) != 0)
+    /* Lookup client information (numeric only: never block on DNS here) */
+    if (getnameinfo((struct sockaddr *)&raddr, rlen, req->host, sizeof(req->host), req->port, sizeof(req->port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
     {
-        fprintf(stderr, "Host name and service cannot be retrieved");
+        fprintf(stderr, "Host name and service cannot be retrieved\n");
         goto fail;
     }
-    /* Open socket stream */
-    if ((req->file = fdopen(req->fd, "r")) == NULL)
+    /* Initialize socket connection buffers */
+    conn_init(&req->conn, req->fd);
+    if (ResolveHosts && resolver_lookup((struct sockaddr *)&raddr, rlen, req->host, name, sizeof(name)))
     {
-        fprintf(stderr, "Cannot open client socket stream");
-        goto fail;
+        log("Accepted request from %s (%s):%s", req->host, name, req->port);
+    }
+    else
+    {
+        log("Accepted request from %s:%s", req->host, req->port);
     }
-    log("Accepted request from %s:%s", req->host, req->port);
     return req;
 
 fail:
@@ -70,7 +73,7 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request socket file descriptor.
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -86,11 +89,13 @@ void free_request(struct request *req)
 
     /* Close socket or fd */
     close(req->fd);
+    fdcache_release(req->file);
     /* Free allocated strings */
     free(req->method);
     free(req->query);
     free(req->path);
     free(req->uri);
+    parser_free(&req->parser);
     /* Free headers */
     header = req->headers;
     while (header != NULL)
@@ -108,158 +113,101 @@ void free_request(struct request *req)
 /**
  * Parse HTTP Request.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This function reads from the request connection and feeds the incremental
+ * parser until the request method, any query, and the headers have been
+ * parsed, returning 0 on success, and -1 on error.  On error, the status to
+ * respond with is recorded in the request parser.
+ *
+ * Reads stop as soon as the parser rejects the request (e.g. because one of
+ * the request size limits was exceeded), so no further input is buffered.
+ * Any bytes following the request head (i.e. the body) are left in the
+ * connection's read-ahead buffer.
  **/
 int parse_request(struct request *req)
 {
-    /* Parse HTTP Request Method */
-    if (parse_request_method(req) < 0)
-    {
-        fprintf(stderr, "parse_request: Failed to parse request method");
+    struct conn *c = &req->conn;
+    ssize_t nread;
+    size_t used;
+    parse_status status = PARSE_NEED_MORE;
+
+    /* Feed buffered data first, then read more as needed */
+    while (true)
+    {
+        if (c->rpos < c->rlen)
+        {
+            status = parser_feed(&req->parser, req, c->rbuf + c->rpos, c->rlen - c->rpos, &used);
+            c->rpos += used;
+        }
+        if (status != PARSE_NEED_MORE)
+        {
+            break;
+        }
+        if ((nread = conn_fill(c)) < 0)
+        {
+            fprintf(stderr, "parse_request: Failed to read request: %s\n", strerror(errno));
+            req->parser.status = HTTP_STATUS_BAD_REQUEST;
+            return -1;
+        }
+        if (nread == 0)
+        {
+            fprintf(stderr, "parse_request: Connection closed before end of request\n");
+            req->parser.status = HTTP_STATUS_BAD_REQUEST;
+            return -1;
+        }
+    }
+
+    if (status == PARSE_ERROR)
+    {
+        fprintf(stderr, "parse_request: Failed to parse request\n");
         return -1;
-    };
-    /* Parse HTTP Requet Headers*/
-    if (parse_request_headers(req) < 0)
+    }
+
+    debug("HTTP METHOD: %s", req->method);
+    debug("HTTP URI:    %s", req->uri);
+    debug("HTTP QUERY:  %s", req->query);
+#ifndef NDEBUG
+    for (struct header *header = req->headers; header != NULL; header = header->next)
     {
-        fprintf(stderr, "parse_request: Failed to parse request headers");
-        return -1;
+        debug("HTTP HEADER %s = %s", header->name, header->value);
     }
+#endif
     return 0;
 }
 
 /**
- * Parse HTTP Request Method and URI
- *
- * HTTP Requests come in the form
- *
- *  <METHOD> <URI>[QUERY] HTTP/<VERSION>
- *
- * Examples:
- *
- *  GET / HTTP/1.1
- *  GET /cgi.script?q=foo HTTP/1.0
+ * Lookup request header by name (case-insensitive).
  *
- * This function extracts the method, uri, and query (if it exists).
+ * Returns the value of the first header with the specified name, or NULL if
+ * the request has no such header.
  **/
-int parse_request_method(struct request *r)
+const char *request_header(struct request *req, const char *name)
 {
-    /* Read line from socket */
-    char *buff = NULL;
-    size_t ln;
-    if (getline(&buff, &ln, r->file) < 0)
+    for (struct header *header = req->headers; header != NULL; header = header->next)
     {
-        fprintf(stderr, "Failed to parse request method");
-        return -1;
-    }
-
-    /* Parse method and uri */
-    char *method_begin;
-    char *method;
-    char *whitespace_begin;
-    char *uri_begin;
-    char *uri_and_query;
-    char *uri;
-    char *query;
-
-    if ((method_begin = skip_whitespace(buff)) == NULL)
-    {
-        fprintf(stderr, "skip_whitespace: Failed to parse request method.\n");
-        goto fail;
-    }
-    if ((method = strtok(method_begin, WHITESPACE)) == NULL)
-    {
-        fprintf(stderr, "strtok: Failed to parse request method.\n");
-        goto fail;
-    }
-    if ((whitespace_begin = skip_nonwhitespace(method_begin)) == NULL)
-    {
-        fprintf(stderr, "skip_nonwhitespace: Failed to parse request uri.\n");
-        goto fail;
-    }
-    if ((uri_begin = skip_whitespace(whitespace_begin) == NULL))
-    {
-        fprintf(stderr, "skip_whitespace: Failed to parse request uri\n");
-        goto fail;
+        if (strcasecmp(header->name, name) == 0)
+        {
+            return header->value;
+        }
     }
-    if ((uri_and_query = strtok(uri_begin, WHITESPACE)) == NULL)
-    {
-        fprintf(stderr, "strtok: Failed to parse uri and query\n");
-        goto fail;
-    }
-    if ((uri = strtok(uri_and_query, "?")) == NULL)
-    {
-        fprintf(stderr, "strtok: Failed to parse uri.\n");
-        goto fail;
-    }
-    if ((query = strchr(uri_and_query, "?") + 1) == NULL)
-    {
-        fprintf(stderr, "strch: Failed to parse querry.\n");
-        goto fail;
-    }
-    /* Record method, uri, and query in request struct */
-    if (
-        (r->method = strdup(method)) == NULL ||
-        (r->uri = strdup(uri)) == NULL ||
-        (r->query = strdup(query)) == NULL)
-    {
-        fprintf(stderr, "Memory allocation failed for request attributes\n");
-        goto fail;
-    }
-
-    debug("HTTP METHOD: %s", r->method);
-    debug("HTTP URI:    %s", r->uri);
-    debug("HTTP QUERY:  %s", r->query);
-
-    return 0;
-
-fail:
-    return -1;
+    return NULL;
 }
 
 /**
- * Parse HTTP Request Headers
- *
- * HTTP Headers come in the form:
- *
- *  <NAME>: <VALUE>
- *
- * Example:
- *
- *  Host: localhost:8888
- *  User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:29.0) Gecko/20100101 Firefox/29.0
- *  Accept: text/html,application/xhtml+xml
- *  Accept-Language: en-US,en;q=0.5
- *  Accept-Encoding: gzip, deflate
- *  Connection: keep-alive
- *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
+ * Determine length of request body from the Content-Length header (0 if the
+ * request has none).
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, value = buffer.split(':')
- *      header      = new Header(name, value)
- *      headers.append(header)
+ * Returns 0 on success, -1 if the header is malformed (e.g. negative).
  **/
-int parse_request_headers(struct request *r)
+int request_content_length(struct request *req, size_t *length)
 {
-    struct header *curr = NULL;
-    char buffer[BUFSIZ];
-    char *name;
-    char *value;
+    const char *value = request_header(req, "Content-Length");
 
-    /* Parse headers from socket */
-
-#ifndef NDEBUG
-    for (struct header *header = r->headers; header != NULL; header = header->next)
+    *length = 0;
+    if (value == NULL)
     {
-        debug("HTTP HEADER %s = %s", header->name, header->value);
+        return 0;
     }
-#endif
-    return 0;
-
-fail:
-    return -1;
+    return parse_number(value, length);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
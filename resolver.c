@@ -0,0 +1,178 @@
+/* resolver.c: Background Client Name Resolver */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+/* Constants */
+
+#define RESOLVER_CACHE_SIZE	1024	/* Direct-mapped cache slots */
+#define RESOLVER_QUEUE_SIZE	64	/* Pending lookups before dropping */
+#define RESOLVER_TTL		300	/* Seconds to keep a resolved name */
+#define RESOLVER_NEGATIVE_TTL	30	/* Seconds to keep a failed lookup */
+
+/* Internal Structures */
+
+struct resolver_entry {
+    char    host[NI_MAXHOST];	/* Numeric host (cache key) */
+    char    name[NI_MAXHOST];	/* Resolved name (empty until resolved) */
+    time_t  expires;		/* When the resolved name goes stale */
+    bool    pending;		/* Lookup queued or in progress */
+};
+
+struct resolver_job {
+    struct sockaddr_storage addr;
+    socklen_t		    addrlen;
+    char		    host[NI_MAXHOST];
+    size_t		    slot;
+};
+
+/* Internal Variables */
+
+static struct resolver_entry	Entries[RESOLVER_CACHE_SIZE];
+static struct resolver_job	Jobs[RESOLVER_QUEUE_SIZE];
+static size_t			JobsHead = 0;
+static size_t			JobsCount = 0;
+static bool			Running = false;
+static pthread_mutex_t		Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		Ready = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Hash numeric host string into cache slot (FNV-1a).
+ **/
+static size_t
+resolver_slot(const char *host)
+{
+    size_t hash = 2166136261u;
+
+    for (const char *c = host; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash % RESOLVER_CACHE_SIZE;
+}
+
+/**
+ * Resolver thread: perform reverse lookups queued by resolver_lookup.
+ **/
+static void *
+resolver_thread(void *arg)
+{
+    struct resolver_job job;
+    char name[NI_MAXHOST];
+
+    while (true) {
+        /* Wait for job */
+        pthread_mutex_lock(&Lock);
+        while (JobsCount == 0) {
+            pthread_cond_wait(&Ready, &Lock);
+        }
+        job = Jobs[JobsHead];
+        JobsHead = (JobsHead + 1) % RESOLVER_QUEUE_SIZE;
+        JobsCount--;
+        pthread_mutex_unlock(&Lock);
+
+        /* Blocking reverse lookup, outside of the lock */
+        int status = getnameinfo((struct sockaddr *)&job.addr, job.addrlen, name, sizeof(name), NULL, 0, NI_NAMEREQD);
+
+        /* Record result if the slot still belongs to this host */
+        pthread_mutex_lock(&Lock);
+        struct resolver_entry *e = &Entries[job.slot];
+        if (streq(e->host, job.host)) {
+            if (status == 0) {
+                snprintf(e->name, sizeof(e->name), "%s", name);
+                e->expires = time(NULL) + RESOLVER_TTL;
+            } else {
+                snprintf(e->name, sizeof(e->name), "%s", job.host);
+                e->expires = time(NULL) + RESOLVER_NEGATIVE_TTL;
+            }
+            e->pending = false;
+        }
+        pthread_mutex_unlock(&Lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start background resolver thread.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+resolver_start(void)
+{
+    pthread_t thread;
+    int status;
+
+    if ((status = pthread_create(&thread, NULL, resolver_thread, NULL)) != 0) {
+        fprintf(stderr, "Unable to start resolver: %s\n", strerror(status));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    pthread_mutex_lock(&Lock);
+    Running = true;
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
+
+/**
+ * Lookup cached client name.
+ *
+ * If a fresh name for the numeric host is cached, then it is copied into name
+ * and true is returned.  Otherwise, a reverse lookup of addr is queued for the
+ * resolver thread (unless one is already pending or the queue is full) and
+ * false is returned.  This never blocks on DNS, so it is safe to call from
+ * the request path; results are only meant for logging.
+ **/
+bool
+resolver_lookup(const struct sockaddr *addr, socklen_t addrlen, const char *host, char *name, size_t n)
+{
+    bool found = false;
+    size_t slot = resolver_slot(host);
+    struct resolver_entry *e = &Entries[slot];
+
+    pthread_mutex_lock(&Lock);
+    if (!Running) {
+        goto done;
+    }
+
+    if (streq(e->host, host) && e->name[0] && e->expires > time(NULL)) {
+        strncpy(name, e->name, n - 1);
+        name[n - 1] = '\0';
+        found = true;
+        goto done;
+    }
+
+    if (streq(e->host, host) && e->pending) {
+        goto done;
+    }
+
+    if (JobsCount < RESOLVER_QUEUE_SIZE && addrlen <= sizeof(struct sockaddr_storage)) {
+        struct resolver_job *job = &Jobs[(JobsHead + JobsCount) % RESOLVER_QUEUE_SIZE];
+
+        memcpy(&job->addr, addr, addrlen);
+        job->addrlen = addrlen;
+        strncpy(job->host, host, sizeof(job->host) - 1);
+        job->host[sizeof(job->host) - 1] = '\0';
+        job->slot = slot;
+        JobsCount++;
+
+        /* Claim slot for this host (evicting any previous occupant) */
+        strcpy(e->host, job->host);
+        e->name[0] = '\0';
+        e->pending = true;
+        pthread_cond_signal(&Ready);
+    }
+
+done:
+    pthread_mutex_unlock(&Lock);
+    return found;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,237 @@
+/* response.c: HTTP Response Head Builder */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Header names, indexed by header_name */
+#define HEADER(s)   {s ": ", sizeof(s ": ") - 1}
+
+static const struct {
+    const char *name;
+    size_t	length;
+} Headers[HEADER_MAX] = {
+    [HEADER_ACCEPT_RANGES]	= HEADER("Accept-Ranges"),
+    [HEADER_CONNECTION]		= HEADER("Connection"),
+    [HEADER_CONTENT_ENCODING]	= HEADER("Content-Encoding"),
+    [HEADER_CONTENT_LENGTH]	= HEADER("Content-Length"),
+    [HEADER_CONTENT_RANGE]	= HEADER("Content-Range"),
+    [HEADER_CONTENT_TYPE]	= HEADER("Content-Type"),
+    [HEADER_DATE]		= HEADER("Date"),
+    [HEADER_ETAG]		= HEADER("ETag"),
+    [HEADER_LAST_MODIFIED]	= HEADER("Last-Modified"),
+    [HEADER_TRANSFER_ENCODING]	= HEADER("Transfer-Encoding"),
+    [HEADER_VARY]		= HEADER("Vary"),
+};
+
+/* Pairs of decimal digits for 00 through 99 */
+static const char Digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Current HTTP date, refreshed at most once per second (seqlock) */
+static struct {
+    unsigned	sequence;		/* Odd while being refreshed */
+    time_t	second;			/* Second the date was formatted for */
+    char	date[DATE_MAX];
+} Clock = {0, -1, ""};
+
+/* Functions */
+
+/**
+ * Format unsigned number in decimal into buffer (of at least NUMBER_MAX
+ * bytes, not NUL-terminated), two digits at a time.
+ *
+ * Returns number of digits.
+ **/
+size_t
+format_number(char *buffer, unsigned long long value)
+{
+    char   digits[NUMBER_MAX];
+    char  *p = digits + sizeof(digits);
+    size_t n;
+
+    while (value >= 100) {
+        const char *pair = Digits + (value % 100) * 2;
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (value >= 10) {
+        *--p = Digits[value * 2 + 1];
+        *--p = Digits[value * 2];
+    } else {
+        *--p = '0' + value;
+    }
+
+    n = digits + sizeof(digits) - p;
+    memcpy(buffer, p, n);
+    return n;
+}
+
+/**
+ * Format current time as HTTP date into buffer (of at least DATE_MAX bytes).
+ *
+ * The date is formatted at most once per second for the whole process and
+ * shared through a seqlock: readers copy it without taking a lock and retry if
+ * it was refreshed meanwhile, and whichever thread first notices a new second
+ * refreshes it.
+ **/
+void
+format_http_now(char *buffer, size_t n)
+{
+    time_t   now = time(NULL);
+    unsigned sequence;
+
+    while (true) {
+        sequence = __atomic_load_n(&Clock.sequence, __ATOMIC_ACQUIRE);
+
+        /* Refresh date for new second (unless another thread is at it) */
+        if (!(sequence & 1) && __atomic_load_n(&Clock.second, __ATOMIC_RELAXED) < now) {
+            if (__atomic_compare_exchange_n(&Clock.sequence, &sequence, sequence + 1, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                format_http_date(now, Clock.date, sizeof(Clock.date));
+                __atomic_store_n(&Clock.second, now, __ATOMIC_RELAXED);
+                __atomic_store_n(&Clock.sequence, sequence + 2, __ATOMIC_RELEASE);
+            }
+            continue;
+        }
+        if (sequence & 1) {
+            continue;
+        }
+
+        /* Copy date, then make sure it was not refreshed meanwhile */
+        snprintf(buffer, n, "%s", Clock.date);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&Clock.sequence, __ATOMIC_RELAXED) == sequence) {
+            return;
+        }
+    }
+}
+
+/**
+ * Append data to response head (anything past the end of the buffer is
+ * dropped, see head_finish).
+ **/
+void
+head_append(struct head *h, const char *data, size_t n)
+{
+    if (h->length + n <= h->size) {
+        memcpy(h->buffer + h->length, data, n);
+    }
+    h->length += n;
+}
+
+/**
+ * Append unsigned number in decimal to response head.
+ **/
+void
+head_append_number(struct head *h, unsigned long long value)
+{
+    char buffer[NUMBER_MAX];
+
+    head_append(h, buffer, format_number(buffer, value));
+}
+
+/**
+ * Start response head in caller-provided buffer (of size n) with the status
+ * line (for HTTP version, e.g. 10 or 11) and the current Date.
+ *
+ * The Date value is always DATE_LENGTH bytes long and its offset is stored in
+ * the head (date), so prepared responses can have it replaced later.
+ **/
+void
+head_start(struct head *h, char *buffer, size_t n, http_status status, int version)
+{
+    const char *status_string = http_status_string(status);
+    char date[DATE_MAX];
+
+    h->buffer = buffer;
+    h->size   = n;
+    h->length = 0;
+
+    head_append(h, version >= 11 ? "HTTP/1.1 " : "HTTP/1.0 ", sizeof("HTTP/1.x ") - 1);
+    head_append(h, status_string, strlen(status_string));
+    head_append(h, "\r\n", 2);
+    head_append(h, Headers[HEADER_DATE].name, Headers[HEADER_DATE].length);
+    h->date = h->length;
+    format_http_now(date, sizeof(date));
+    head_append(h, date, DATE_LENGTH);
+    head_append(h, "\r\n", 2);
+}
+
+/**
+ * Append header with value to response head.
+ **/
+void
+head_add(struct head *h, header_name name, const char *value)
+{
+    head_append(h, Headers[name].name, Headers[name].length);
+    head_append(h, value, strlen(value));
+    head_append(h, "\r\n", 2);
+}
+
+/**
+ * Append header with numeric value to response head.
+ **/
+void
+head_add_number(struct head *h, header_name name, unsigned long long value)
+{
+    head_append(h, Headers[name].name, Headers[name].length);
+    head_append_number(h, value);
+    head_append(h, "\r\n", 2);
+}
+
+/**
+ * Append Content-Range header for byte range first-last of size bytes (or
+ * for an unsatisfiable range if range is NULL) to response head.
+ **/
+void
+head_add_range(struct head *h, const struct range *range, off_t size)
+{
+    head_append(h, Headers[HEADER_CONTENT_RANGE].name, Headers[HEADER_CONTENT_RANGE].length);
+    head_append(h, "bytes ", 6);
+    if (range) {
+        head_append_number(h, range->first);
+        head_append(h, "-", 1);
+        head_append_number(h, range->last);
+    } else {
+        head_append(h, "*", 1);
+    }
+    head_append(h, "/", 1);
+    head_append_number(h, size);
+    head_append(h, "\r\n", 2);
+}
+
+/**
+ * Finish response head with the blank line.
+ *
+ * Returns the length of the head, or -1 if it did not fit into the buffer.
+ **/
+ssize_t
+head_finish(struct head *h)
+{
+    head_append(h, "\r\n", 2);
+    return h->length <= h->size ? (ssize_t)h->length : -1;
+}
+
+/**
+ * Finish response head and write it to connection.
+ *
+ * Returns 0 on success, -1 on error (or if the head did not fit into the
+ * buffer, in which case nothing is written).
+ **/
+int
+head_write(struct head *h, struct conn *c)
+{
+    ssize_t length = head_finish(h);
+
+    if (length < 0) {
+        return -1;
+    }
+    return conn_write(c, h->buffer, length);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
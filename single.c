@@ -17,14 +17,20 @@ single_server(int sfd)
 
     /* Accept and handle HTTP request */
     while (true) {
-    	/* Accept request */
+        /* Accept request */
+        if ((request = accept_request(sfd)) == NULL) {
+            continue;
+        }
 
-	/* Handle request */
+        /* Handle request */
+        handle_request(request);
 
-	/* Free request */
+        /* Free request */
+        free_request(request);
     }
 
     /* Close socket and exit */
+    close(sfd);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
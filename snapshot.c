@@ -0,0 +1,853 @@
+/* snapshot.c: In-Memory Site Snapshot */
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SNAPSHOT_THREADS    8			/* Most threads walking RootPath */
+#define SNAPSHOT_VARIANTS   4			/* Identity, siblings, compressed */
+#define SNAPSHOT_COMPRESSED 3			/* Variant compressed at load time */
+#define SNAPSHOT_WAIT	    1000000		/* Nanoseconds between reader checks */
+
+/* Content coding (and precompressed sibling suffix) of each variant, with
+ * siblings in order of preference (as in handle_file_request) */
+static const struct {
+    const char *coding;
+    const char *suffix;
+} Variants[SNAPSHOT_VARIANTS] = {
+    {NULL,	NULL},
+    {"br",	".br"},
+    {"gzip",	".gz"},
+    {"gzip",	NULL},
+};
+
+/* Internal Structures */
+
+struct snapshot_variant {
+    const char *head;			/* 200 OK head (NULL if no variant) */
+    size_t	head_length;		/* Length of head */
+    size_t	date;			/* Offset of Date value in head */
+    const char *body;			/* Contents */
+    size_t	length;			/* Length of contents */
+    const char *etag;			/* Validators */
+    const char *modified;
+    time_t	mtime;
+};
+
+struct snapshot_file {
+    const char *key;			/* Path relative to RootPath (NULL if slot unused) */
+    size_t	hash;			/* Hash of key */
+    bool	vary;			/* Response depends on Accept-Encoding */
+    bool	compress;		/* Compressed on the fly by file handler */
+    struct snapshot_variant variants[SNAPSHOT_VARIANTS];
+};
+
+struct snapshot {			/* Immutable once published */
+    struct snapshot_file *files;	/* Hash table (open addressing) */
+    size_t	slots;			/* Slots in table (power of two) */
+    size_t	count;			/* Files in table */
+    char       *arena;			/* Keys, contents, validators, and heads */
+    size_t	size;			/* Size of arena */
+};
+
+struct snapshot_load {			/* File read by the walk */
+    char       *key;			/* Path relative to RootPath */
+    struct stat st;			/* Status when read */
+    char       *data;			/* Contents */
+    char       *type;			/* Mimetype (servable files only) */
+    char       *compressed;		/* Compressed variant (may be NULL) */
+    size_t	compressed_length;
+    bool	servable;		/* Served by file handler as is */
+    struct snapshot_load *siblings[SNAPSHOT_VARIANTS];
+    const char *packed[2];		/* Contents and compressed variant in arena */
+    struct snapshot_load *next;
+};
+
+struct snapshot_walk {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    char	  **queue;		/* Directories to read */
+    size_t	    queued;
+    size_t	    capacity;
+    size_t	    pending;		/* Directories queued or being read */
+    struct snapshot_load *loads;	/* Files read */
+};
+
+/* Internal Variables */
+
+static struct snapshot *Current = NULL;
+static size_t		Epoch = 0;	/* Readers enter Readers[Epoch & 1] */
+static size_t		Readers[2] = {0, 0};
+static size_t		Generation = 0;
+static size_t		Hits = 0;
+static size_t		Misses = 0;
+
+/* Internal Functions */
+
+/**
+ * Hash key (FNV-1a).
+ **/
+static size_t
+snapshot_hash(const char *key)
+{
+    size_t hash = 2166136261u;
+
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Compare loads by key (for qsort and bsearch).
+ **/
+static int
+snapshot_compare(const void *a, const void *b)
+{
+    return strcmp((*(struct snapshot_load * const *)a)->key, (*(struct snapshot_load * const *)b)->key);
+}
+
+/**
+ * Queue directory (path relative to RootPath) for the walk.
+ **/
+static void
+snapshot_queue(struct snapshot_walk *w, char *relative)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->queued == w->capacity) {
+        size_t capacity = w->capacity ? 2 * w->capacity : 64;
+        char **queue = realloc(w->queue, capacity * sizeof(char *));
+
+        if (queue == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            free(relative);
+            return;
+        }
+        w->queue    = queue;
+        w->capacity = capacity;
+    }
+    w->queue[w->queued++] = relative;
+    w->pending++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Read regular file name in directory dfd, which must still match st.
+ *
+ * Returns newly allocated contents on success, NULL on error.
+ **/
+static char *
+snapshot_read(int dfd, const char *name, const struct stat *st)
+{
+    struct stat now;
+    char  *data;
+    size_t size = st->st_size;
+    int    fd;
+
+    if ((fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    if ((data = malloc(size ? size : 1)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    for (size_t offset = 0; offset < size; ) {
+        ssize_t nread = pread(fd, data + offset, size - offset, offset);
+        if (nread <= 0) {
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        offset += nread;
+    }
+    if (fstat(fd, &now) < 0 || now.st_ino != st->st_ino || now.st_size != st->st_size ||
+        now.st_mtim.tv_sec != st->st_mtim.tv_sec || now.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+        free(data);
+        data = NULL;
+    }
+    close(fd);
+    return data;
+}
+
+/**
+ * Free loaded file.
+ **/
+static void
+snapshot_unload(struct snapshot_load *l)
+{
+    free(l->key);
+    free(l->data);
+    free(l->type);
+    free(l->compressed);
+    free(l);
+}
+
+/**
+ * Read directory (path relative to RootPath): queue its subdirectories, and
+ * load its regular files up to SnapshotMax bytes.
+ *
+ * Since precompressed siblings (foo.html.gz) live next to their files, each
+ * file is matched with its siblings here.  A file with a sibling that could
+ * not be loaded is left to the file handler (as are CGI scripts).  Files that
+ * the file handler compresses on the fly are compressed now.
+ **/
+static void
+snapshot_directory(struct snapshot_walk *w, const char *relative)
+{
+    struct snapshot_load **loads = NULL;
+    struct dirent *entry;
+    size_t count = 0;
+    size_t capacity = 0;
+    DIR   *dir;
+    int    dfd;
+
+    if ((dfd = openat(RootFd, relative, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        debug("Unable to open %s: %s", relative, strerror(errno));
+        return;
+    }
+    if ((dir = fdopendir(dfd)) == NULL) {
+        close(dfd);
+        return;
+    }
+
+    /* Queue subdirectories, read small regular files */
+    while ((entry = readdir(dir))) {
+        struct snapshot_load *l;
+        struct stat st;
+        char key[PATH_MAX];
+
+        if (streq(entry->d_name, ".") || streq(entry->d_name, "..") ||
+            fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        if (streq(relative, ".")) {
+            snprintf(key, sizeof(key), "%s", entry->d_name);
+        } else if (snprintf(key, sizeof(key), "%s/%s", relative, entry->d_name) >= (int)sizeof(key)) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            char *child = strdup(key);
+            if (child) {
+                snapshot_queue(w, child);
+            }
+            continue;
+        }
+        if (determine_request_type(&st) != REQUEST_FILE || (size_t)st.st_size > SnapshotMax) {
+            continue;
+        }
+
+        if (count == capacity) {
+            struct snapshot_load **grown = realloc(loads, (capacity ? 2 * capacity : 64) * sizeof(*loads));
+            if (grown == NULL) {
+                continue;
+            }
+            loads    = grown;
+            capacity = capacity ? 2 * capacity : 64;
+        }
+        if ((l = calloc(1, sizeof(struct snapshot_load))) == NULL ||
+            (l->key = strdup(key)) == NULL || (l->data = snapshot_read(dfd, entry->d_name, &st)) == NULL) {
+            if (l) {
+                snapshot_unload(l);
+            }
+            continue;
+        }
+        l->st = st;
+        loads[count++] = l;
+    }
+
+    /* Match files with their siblings, determine types, compress */
+    qsort(loads, count, sizeof(*loads), snapshot_compare);
+    for (size_t i = 0; i < count; i++) {
+        struct snapshot_load *l = loads[i];
+        const char *name = strrchr(l->key, '/') ? strrchr(l->key, '/') + 1 : l->key;
+
+        l->servable = true;
+        for (size_t v = 1; v < SNAPSHOT_VARIANTS && l->servable; v++) {
+            struct snapshot_load probe;
+            struct snapshot_load *key = &probe;
+            struct snapshot_load **sibling;
+            struct stat st;
+            char path[PATH_MAX];
+
+            if (Variants[v].suffix == NULL) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s%s", name, Variants[v].suffix);
+            if (fstatat(dfd, path, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s%s", l->key, Variants[v].suffix);
+            probe.key = path;
+            if ((sibling = bsearch(&key, loads, count, sizeof(*loads), snapshot_compare))) {
+                l->siblings[v] = *sibling;
+            } else {
+                l->servable = false;
+            }
+        }
+        if (!l->servable || (l->type = determine_mimetype(l->key)) == NULL) {
+            l->servable = false;
+            continue;
+        }
+
+        if (CompressLevel > 0 && l->st.st_size >= COMPRESS_MIN && cache_fits(l->st.st_size) && compress_type(l->type)) {
+            l->compressed = compress_buffer(l->data, l->st.st_size, Variants[SNAPSHOT_COMPRESSED].coding, &l->compressed_length);
+            if (l->compressed == NULL) {
+                l->servable = false;
+            }
+        }
+    }
+    closedir(dir);
+
+    /* Hand loaded files to the walk */
+    pthread_mutex_lock(&w->lock);
+    for (size_t i = 0; i < count; i++) {
+        loads[i]->next = w->loads;
+        w->loads = loads[i];
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(loads);
+}
+
+/**
+ * Read queued directories until the walk is done (thread entry point).
+ **/
+static void *
+snapshot_walker(void *arg)
+{
+    struct snapshot_walk *w = arg;
+    char *relative;
+
+    pthread_mutex_lock(&w->lock);
+    while (true) {
+        while (w->queued == 0 && w->pending > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->queued == 0) {
+            break;
+        }
+        relative = w->queue[--w->queued];
+        pthread_mutex_unlock(&w->lock);
+
+        snapshot_directory(w, relative);
+        free(relative);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->pending == 0) {
+            pthread_cond_broadcast(&w->cond);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/**
+ * Format validators and head of variant v of loaded file into buffer (of
+ * size n).
+ *
+ * Returns the length of the head, or -1 if it did not fit.
+ **/
+static ssize_t
+snapshot_head(const struct snapshot_load *l, size_t v, struct head *h, char *buffer, size_t n, char *etag, char *modified)
+{
+    const struct snapshot_load *source = l->siblings[v] ? l->siblings[v] : l;
+    bool vary = l->compressed || l->siblings[1] || l->siblings[2];
+
+    format_etag(&source->st, etag, ETAG_MAX);
+    if (v == SNAPSHOT_COMPRESSED) {
+        size_t length = strlen(etag);
+        snprintf(etag + length - 1, ETAG_MAX - length + 1, "-%s\"", Variants[v].coding);
+    }
+    format_http_date(source->st.st_mtim.tv_sec, modified, DATE_MAX);
+
+    head_start(h, buffer, n, HTTP_STATUS_OK, 10);
+    head_add(h, HEADER_CONTENT_TYPE, l->type);
+    head_add_number(h, HEADER_CONTENT_LENGTH, v == SNAPSHOT_COMPRESSED ? l->compressed_length : (size_t)source->st.st_size);
+    head_add(h, HEADER_ACCEPT_RANGES, "bytes");
+    head_add(h, HEADER_ETAG, etag);
+    head_add(h, HEADER_LAST_MODIFIED, modified);
+    if (Variants[v].coding) {
+        head_add(h, HEADER_CONTENT_ENCODING, Variants[v].coding);
+    }
+    if (vary) {
+        head_add(h, HEADER_VARY, "Accept-Encoding");
+    }
+    return head_finish(h);
+}
+
+/**
+ * Return whether loaded file has variant v.
+ **/
+static bool
+snapshot_has_variant(const struct snapshot_load *l, size_t v)
+{
+    return v == 0 || l->siblings[v] || (v == SNAPSHOT_COMPRESSED && l->compressed);
+}
+
+/**
+ * Copy data into arena at cursor.
+ *
+ * Returns the copy.
+ **/
+static const char *
+snapshot_copy(char **cursor, const void *data, size_t n)
+{
+    char *copy = *cursor;
+
+    memcpy(copy, data, n);
+    *cursor += n;
+    return copy;
+}
+
+/**
+ * Pack loaded files into image: one arena holding every key, contents,
+ * validators, and head, and a hash table of the servable files.
+ *
+ * Returns newly allocated image on success, NULL on error.
+ **/
+static struct snapshot *
+snapshot_pack(struct snapshot_load *loads)
+{
+    struct snapshot *s;
+    struct head h;
+    char   head[BUFSIZ];
+    char   etag[ETAG_MAX];
+    char   modified[DATE_MAX];
+    char  *cursor;
+    size_t count = 0;
+
+    if ((s = calloc(1, sizeof(struct snapshot))) == NULL) {
+        return NULL;
+    }
+
+    /* Measure arena */
+    for (struct snapshot_load *l = loads; l; l = l->next) {
+        s->size += l->st.st_size + l->compressed_length;
+        if (!l->servable) {
+            continue;
+        }
+        s->size += strlen(l->key) + 1;
+        for (size_t v = 0; v < SNAPSHOT_VARIANTS; v++) {
+            ssize_t length;
+
+            if (!snapshot_has_variant(l, v)) {
+                continue;
+            }
+            if ((length = snapshot_head(l, v, &h, head, sizeof(head), etag, modified)) < 0) {
+                l->servable = false;
+                break;
+            }
+            s->size += length + strlen(etag) + 1 + strlen(modified) + 1;
+        }
+        count += l->servable;
+    }
+
+    for (s->slots = 16; s->slots < 2 * count; s->slots *= 2);
+    if ((s->files = calloc(s->slots, sizeof(struct snapshot_file))) == NULL ||
+        (s->arena = malloc(s->size ? s->size : 1)) == NULL) {
+        free(s->files);
+        free(s);
+        return NULL;
+    }
+
+    /* Pack contents (which siblings share), then servable files */
+    cursor = s->arena;
+    for (struct snapshot_load *l = loads; l; l = l->next) {
+        l->packed[0] = snapshot_copy(&cursor, l->data, l->st.st_size);
+        l->packed[1] = l->compressed ? snapshot_copy(&cursor, l->compressed, l->compressed_length) : NULL;
+    }
+    for (struct snapshot_load *l = loads; l; l = l->next) {
+        struct snapshot_file *f;
+        size_t hash;
+
+        if (!l->servable) {
+            continue;
+        }
+        hash = snapshot_hash(l->key);
+        for (f = &s->files[hash & (s->slots - 1)]; f->key; f = &s->files[(f - s->files + 1) & (s->slots - 1)]);
+
+        f->key      = snapshot_copy(&cursor, l->key, strlen(l->key) + 1);
+        f->hash     = hash;
+        f->vary     = l->compressed || l->siblings[1] || l->siblings[2];
+        f->compress = l->compressed != NULL;
+        for (size_t v = 0; v < SNAPSHOT_VARIANTS; v++) {
+            struct snapshot_variant *variant = &f->variants[v];
+            const struct snapshot_load *source = l->siblings[v] ? l->siblings[v] : l;
+            ssize_t length;
+
+            if (!snapshot_has_variant(l, v)) {
+                continue;
+            }
+            length = snapshot_head(l, v, &h, head, sizeof(head), etag, modified);
+            variant->head        = snapshot_copy(&cursor, head, length);
+            variant->head_length = length;
+            variant->date        = h.date;
+            variant->body        = v == SNAPSHOT_COMPRESSED ? l->packed[1] : source->packed[0];
+            variant->length      = v == SNAPSHOT_COMPRESSED ? l->compressed_length : (size_t)source->st.st_size;
+            variant->etag        = snapshot_copy(&cursor, etag, strlen(etag) + 1);
+            variant->modified    = snapshot_copy(&cursor, modified, strlen(modified) + 1);
+            variant->mtime       = source->st.st_mtim.tv_sec;
+        }
+        s->count++;
+    }
+    return s;
+}
+
+/**
+ * Build image of RootPath, walking its directories in parallel.
+ *
+ * Returns newly allocated image on success, NULL on error.
+ **/
+static struct snapshot *
+snapshot_build(void)
+{
+    struct snapshot_walk w = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    struct snapshot *s;
+    pthread_t threads[SNAPSHOT_THREADS];
+    long   online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = 0;
+    char  *root;
+
+    if ((root = strdup(".")) == NULL) {
+        return NULL;
+    }
+    snapshot_queue(&w, root);
+
+    /* Walk with helper threads and this one */
+    while (nthreads + 1 < (size_t)(online > 0 ? online : 1) && nthreads < SNAPSHOT_THREADS - 1 &&
+           pthread_create(&threads[nthreads], NULL, snapshot_walker, &w) == 0) {
+        nthreads++;
+    }
+    snapshot_walker(&w);
+    for (size_t i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(w.queue);
+
+    s = snapshot_pack(w.loads);
+    while (w.loads) {
+        struct snapshot_load *next = w.loads->next;
+        snapshot_unload(w.loads);
+        w.loads = next;
+    }
+    return s;
+}
+
+/**
+ * Free image.
+ **/
+static void
+snapshot_free(struct snapshot *s)
+{
+    if (s) {
+        free(s->files);
+        free(s->arena);
+        free(s);
+    }
+}
+
+/**
+ * Enter reader section: returns current image (and sets reader), which stays
+ * valid until snapshot_leave.
+ **/
+static struct snapshot *
+snapshot_enter(size_t *reader)
+{
+    *reader = __atomic_load_n(&Epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&Readers[*reader], 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&Current, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Leave reader section.
+ **/
+static void
+snapshot_leave(size_t reader)
+{
+    __atomic_sub_fetch(&Readers[reader], 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wait until every reader that may still use a replaced image has left.
+ *
+ * Readers count themselves in one of two counters, chosen by Epoch.  Each
+ * flip of the epoch sends new readers to the other counter, so the one being
+ * waited on drains; after both have drained once, no reader can hold an image
+ * replaced before the first flip.
+ **/
+static void
+snapshot_synchronize(void)
+{
+    struct timespec wait = {0, SNAPSHOT_WAIT};
+
+    for (int flip = 0; flip < 2; flip++) {
+        size_t epoch = __atomic_fetch_add(&Epoch, 1, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(&Readers[epoch & 1], __ATOMIC_SEQ_CST) > 0) {
+            nanosleep(&wait, NULL);
+        }
+    }
+}
+
+/**
+ * Build new image of RootPath and swap it in, freeing the previous one once
+ * its readers have left.
+ *
+ * Returns 0 on success, -1 on error (the previous image stays in place).
+ **/
+static int
+snapshot_reload(void)
+{
+    struct snapshot *s;
+    struct snapshot *old;
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((s = snapshot_build()) == NULL) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    old = __atomic_exchange_n(&Current, s, __ATOMIC_SEQ_CST);
+    snapshot_synchronize();
+    snapshot_free(old);
+    __atomic_add_fetch(&Generation, 1, __ATOMIC_RELAXED);
+
+    log("Snapshot of %s: %zu files, %zu bytes (%.3f seconds)", RootPath, s->count, s->size,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
+
+/**
+ * Reload image whenever SIGHUP arrives (thread entry point).
+ **/
+static void *
+snapshot_thread(void *arg)
+{
+    const sigset_t *signals = arg;
+    int signal;
+
+    while (true) {
+        if (sigwait(signals, &signal) == 0 && signal == SIGHUP && snapshot_reload() < 0) {
+            log("Unable to reload snapshot of %s, keeping previous one", RootPath);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find file in image.
+ **/
+static const struct snapshot_file *
+snapshot_find(const struct snapshot *s, const char *key)
+{
+    size_t hash = snapshot_hash(key);
+
+    for (size_t i = hash & (s->slots - 1); s->files[i].key; i = (i + 1) & (s->slots - 1)) {
+        if (s->files[i].hash == hash && streq(s->files[i].key, key)) {
+            return &s->files[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Choose variant of file for request, as handle_file_request would.
+ *
+ * Returns the variant, or NULL if the request is left to the file handler
+ * (e.g. it accepts deflate, but not gzip).
+ **/
+static const struct snapshot_variant *
+snapshot_variant(struct request *r, const struct snapshot_file *f)
+{
+    const char *accept = request_header(r, "Accept-Encoding");
+    const char *coding;
+
+    for (size_t v = 1; v < SNAPSHOT_VARIANTS && accept; v++) {
+        if (v != SNAPSHOT_COMPRESSED && f->variants[v].head && accepts_encoding(accept, Variants[v].coding)) {
+            return &f->variants[v];
+        }
+    }
+    if (f->compress && (coding = compress_coding(accept))) {
+        return streq(coding, Variants[SNAPSHOT_COMPRESSED].coding) ? &f->variants[SNAPSHOT_COMPRESSED] : NULL;
+    }
+    return &f->variants[0];
+}
+
+/**
+ * Determine whether the client's cached copy of the variant is still current
+ * (If-None-Match, or If-Modified-Since in its absence).
+ **/
+static bool
+snapshot_not_modified(struct request *r, const struct snapshot_variant *v)
+{
+    const char *value;
+    time_t since;
+
+    if (!streq(r->method, "GET") && !streq(r->method, "HEAD")) {
+        return false;
+    }
+    if ((value = request_header(r, "If-None-Match"))) {
+        return etag_matches(value, v->etag, false);
+    }
+    if ((value = request_header(r, "If-Modified-Since")) && (since = parse_http_date(value)) >= 0) {
+        return v->mtime <= since;
+    }
+    return false;
+}
+
+/* Functions */
+
+/**
+ * Load snapshot of RootPath and start reloading it on SIGHUP.
+ *
+ * Every regular file up to SnapshotMax bytes is read into one in-memory
+ * image, along with its mimetype, validators, precompressed siblings or
+ * compressed variant, and serialized response heads, so that snapshot_handle
+ * serves it without touching the filesystem.  SIGHUP (e.g. after a deploy)
+ * builds a new image and swaps it in atomically; the previous one is freed
+ * once the requests still reading it are done.
+ *
+ * SIGHUP is blocked here and waited for by a dedicated thread, so this must
+ * be called before any other thread is started.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int
+snapshot_start(void)
+{
+    static sigset_t signals;
+    pthread_t thread;
+    int status;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    if ((status = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0) {
+        fprintf(stderr, "Unable to block SIGHUP: %s\n", strerror(status));
+        return -1;
+    }
+
+    if (snapshot_reload() < 0) {
+        return -1;
+    }
+
+    if ((status = pthread_create(&thread, NULL, snapshot_thread, &signals)) != 0) {
+        fprintf(stderr, "Unable to create snapshot thread: %s\n", strerror(status));
+        log("Snapshot reloads disabled");
+        return 0;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Serve request from snapshot, if its file is in it.
+ *
+ * Files are looked up by their normalized path in the image's hash table and
+ * sent as their prepared response with the current Date spliced in (or as
+ * 304 Not Modified), in a single writev.  Byte range requests are left to the
+ * file handler.
+ *
+ * Returns whether the request was handled (and sets status).
+ **/
+bool
+snapshot_handle(struct request *r, http_status *status)
+{
+    const struct snapshot *s;
+    const struct snapshot_file *f;
+    const struct snapshot_variant *v;
+    char   relative[PATH_MAX];
+    char   date[DATE_MAX];
+    size_t reader;
+
+    if (__atomic_load_n(&Current, __ATOMIC_RELAXED) == NULL) {
+        return false;
+    }
+    if (normalize_uri(r->uri, relative, sizeof(relative)) < 0 || request_header(r, "Range")) {
+        __atomic_add_fetch(&Misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    s = snapshot_enter(&reader);
+    if ((f = snapshot_find(s, relative)) == NULL || (v = snapshot_variant(r, f)) == NULL) {
+        snapshot_leave(reader);
+        __atomic_add_fetch(&Misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if (snapshot_not_modified(r, v)) {
+        struct head h;
+        char head[BUFSIZ];
+
+        head_start(&h, head, sizeof(head), HTTP_STATUS_NOT_MODIFIED, 10);
+        head_add(&h, HEADER_ETAG, v->etag);
+        head_add(&h, HEADER_LAST_MODIFIED, v->modified);
+        if (v != &f->variants[0]) {
+            head_add(&h, HEADER_CONTENT_ENCODING, Variants[v - f->variants].coding);
+        }
+        if (f->vary) {
+            head_add(&h, HEADER_VARY, "Accept-Encoding");
+        }
+        head_write(&h, &r->conn);
+        conn_flush(&r->conn);
+        *status = HTTP_STATUS_NOT_MODIFIED;
+    } else {
+        struct iovec iov[4] = {
+            {(void *)v->head, v->date},
+            {date, DATE_LENGTH},
+            {(void *)(v->head + v->date + DATE_LENGTH), v->head_length - v->date - DATE_LENGTH},
+            {(void *)v->body, v->length},
+        };
+
+        format_http_now(date, sizeof(date));
+        conn_writev(&r->conn, iov, 4);
+        *status = HTTP_STATUS_OK;
+    }
+
+    snapshot_leave(reader);
+    __atomic_add_fetch(&Hits, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Write snapshot statistics to connection as plain text.
+ **/
+void
+snapshot_write_status(struct conn *c)
+{
+    const struct snapshot *s;
+    size_t reader;
+    size_t files;
+    size_t bytes;
+
+    if (__atomic_load_n(&Current, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    s = snapshot_enter(&reader);
+    files = s->count;
+    bytes = s->size;
+    snapshot_leave(reader);
+
+    conn_printf(c, "snapshot.files %zu\n", files);
+    conn_printf(c, "snapshot.bytes %zu\n", bytes);
+    conn_printf(c, "snapshot.generation %zu\n", __atomic_load_n(&Generation, __ATOMIC_RELAXED));
+    conn_printf(c, "snapshot.hits %zu\n", __atomic_load_n(&Hits, __ATOMIC_RELAXED));
+    conn_printf(c, "snapshot.misses %zu\n", __atomic_load_n(&Misses, __ATOMIC_RELAXED));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -35,20 +35,20 @@ socket_listen(const char *port)
     /* For each server entry, allocate socket and try to connect */
     for (struct addrinfo *p = results; p != NULL && socketfd < 0; p = p->ai_next) {
 	    /* Allocate socket */
-        if ((socketfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
-            fprintf("Failed to make socket: %s\n", strerror(errno));
+        if ((socketfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0) {
+            fprintf(stderr, "Failed to make socket: %s\n", strerror(errno));
             continue;
         }
         /* Bind socket */
         if (bind(socketfd, p->ai_addr, p->ai_addrlen) < 0) {
-            fprintf("Failed to bind socket: %s\n", strerror(errno));
+            fprintf(stderr, "Failed to bind socket: %s\n", strerror(errno));
             close(socketfd);
             socketfd = -1;
             continue;
         }
     	/* Listen to socket */
         if (listen(socketfd, SOMAXCONN) < 0) {
-            fprintf("Failed to listen: %s\n", strerror(errno));
+            fprintf(stderr, "Failed to listen: %s\n", strerror(errno));
             close(socketfd);
             socketfd = -1;
             continue;
@@ -6,6 +6,9 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
 
 /* Global Variables */
@@ -13,25 +16,116 @@ char *Port	      = "9898";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
+int   RootFd	      = -1;
+bool  ResolveHosts    = false;
+size_t RequestLineMax = 8192;
+size_t HeaderLineMax  = 8192;
+size_t HeaderBytesMax = 65536;
+size_t HeaderCountMax = 100;
+size_t CacheSize      = 64 * 1024 * 1024;
+size_t FdCacheSize    = 1024;
+int   CompressLevel   = 6;
+size_t CgiMax         = 64;
+size_t CgiMaxPerScript = 16;
+size_t CgiQueueMax    = 64;
+size_t CgiQueueTimeout = 10;
+char  *CgiCacheVary   = NULL;
+char  *StatusPath     = NULL;
+size_t SnapshotMax    = 0;
 mode  ConcurrencyMode = SINGLE;
 
+/* Long Options */
+
+enum {
+    OPT_MAX_REQUEST_LINE = 256,
+    OPT_MAX_HEADER_LINE,
+    OPT_MAX_HEADER_BYTES,
+    OPT_MAX_HEADERS,
+    OPT_CACHE_SIZE,
+    OPT_FD_CACHE_SIZE,
+    OPT_COMPRESS_LEVEL,
+    OPT_STATUS,
+    OPT_FASTCGI,
+    OPT_CGI_MAX,
+    OPT_CGI_MAX_PER_SCRIPT,
+    OPT_CGI_QUEUE,
+    OPT_CGI_QUEUE_TIMEOUT,
+    OPT_CGI_CACHE,
+    OPT_CGI_CACHE_VARY,
+    OPT_SNAPSHOT,
+};
+
+static struct option LongOptions[] = {
+    {"max-request-line",    required_argument,  NULL, OPT_MAX_REQUEST_LINE},
+    {"max-header-line",     required_argument,  NULL, OPT_MAX_HEADER_LINE},
+    {"max-header-bytes",    required_argument,  NULL, OPT_MAX_HEADER_BYTES},
+    {"max-headers",         required_argument,  NULL, OPT_MAX_HEADERS},
+    {"cache-size",          required_argument,  NULL, OPT_CACHE_SIZE},
+    {"fd-cache-size",       required_argument,  NULL, OPT_FD_CACHE_SIZE},
+    {"compress-level",      required_argument,  NULL, OPT_COMPRESS_LEVEL},
+    {"status",              required_argument,  NULL, OPT_STATUS},
+    {"fastcgi",             required_argument,  NULL, OPT_FASTCGI},
+    {"cgi-max",             required_argument,  NULL, OPT_CGI_MAX},
+    {"cgi-max-per-script",  required_argument,  NULL, OPT_CGI_MAX_PER_SCRIPT},
+    {"cgi-queue",           required_argument,  NULL, OPT_CGI_QUEUE},
+    {"cgi-queue-timeout",   required_argument,  NULL, OPT_CGI_QUEUE_TIMEOUT},
+    {"cgi-cache",           required_argument,  NULL, OPT_CGI_CACHE},
+    {"cgi-cache-vary",      required_argument,  NULL, OPT_CGI_CACHE_VARY},
+    {"snapshot",            required_argument,  NULL, OPT_SNAPSHOT},
+    {NULL,                  0,                  NULL, 0},
+};
+
 /**
  * Display usage message.
  */
 void
 usage(const char *progname, int status)
 {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hcmMpRr]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode       Single, Forking, or Threaded mode\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -R            Resolve client names in background (logging only)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    --cache-size n          Hot file cache budget in bytes, 0 disables (%zu)\n", CacheSize);
+    fprintf(stderr, "    --fd-cache-size n       Open file descriptors to cache, 0 disables (%zu)\n", FdCacheSize);
+    fprintf(stderr, "    --compress-level n      Gzip/deflate level 1-9, 0 disables (%d)\n", CompressLevel);
+    fprintf(stderr, "    --status uri            Serve server status at uri\n");
+    fprintf(stderr, "    --fastcgi uri:n[:max]   Serve CGI script at uri with n FastCGI workers\n");
+    fprintf(stderr, "    --cgi-max n             CGI scripts running at once, 0 unlimited (%zu)\n", CgiMax);
+    fprintf(stderr, "    --cgi-max-per-script n  Instances of one CGI script running at once (%zu)\n", CgiMaxPerScript);
+    fprintf(stderr, "    --cgi-queue n           CGI requests queued per script (%zu)\n", CgiQueueMax);
+    fprintf(stderr, "    --cgi-queue-timeout n   Seconds a CGI request may be queued (%zu)\n", CgiQueueTimeout);
+    fprintf(stderr, "    --cgi-cache uri:ttl     Cache responses of CGI script at uri for ttl seconds\n");
+    fprintf(stderr, "    --cgi-cache-vary list   Request headers cached CGI responses vary by\n");
+    fprintf(stderr, "    --snapshot n            Serve files up to n bytes from memory snapshot (reload on SIGHUP)\n");
+    fprintf(stderr, "Limits (0 disables):\n");
+    fprintf(stderr, "    --max-request-line n    Maximum request line length (%zu)\n", RequestLineMax);
+    fprintf(stderr, "    --max-header-line n     Maximum length of one header (%zu)\n", HeaderLineMax);
+    fprintf(stderr, "    --max-header-bytes n    Maximum size of all headers (%zu)\n", HeaderBytesMax);
+    fprintf(stderr, "    --max-headers n         Maximum number of headers (%zu)\n", HeaderCountMax);
     exit(status);
 }
 
+/**
+ * Parse option value as a non-negative decimal number, or display usage
+ * message if it is not one (e.g. "64k", "", "-1", or too large).
+ **/
+static size_t
+parse_size(const char *progname, const char *value)
+{
+    size_t n;
+
+    if (parse_number(value, &n) < 0) {
+        fprintf(stderr, "Invalid number: %s\n", value);
+        usage(progname, EXIT_FAILURE);
+    }
+    return n;
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
@@ -42,18 +136,164 @@ main(int argc, char *argv[])
     int sfd;
 
     /* Parse command line options */
+    while ((c = getopt_long(argc, argv, "hc:m:M:p:Rr:", LongOptions, NULL)) != -1) {
+        switch (c) {
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'c':
+                if (streq(optarg, "single")) {
+                    ConcurrencyMode = SINGLE;
+                } else if (streq(optarg, "forking")) {
+                    ConcurrencyMode = FORKING;
+                } else if (streq(optarg, "threaded")) {
+                    ConcurrencyMode = THREADED;
+                } else {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                MimeTypesPath = optarg;
+                break;
+            case 'M':
+                DefaultMimeType = optarg;
+                break;
+            case 'p':
+                Port = optarg;
+                break;
+            case 'R':
+                ResolveHosts = true;
+                break;
+            case 'r':
+                RootPath = optarg;
+                break;
+            case OPT_MAX_REQUEST_LINE:
+                RequestLineMax = parse_size(argv[0], optarg);
+                break;
+            case OPT_MAX_HEADER_LINE:
+                HeaderLineMax = parse_size(argv[0], optarg);
+                break;
+            case OPT_MAX_HEADER_BYTES:
+                HeaderBytesMax = parse_size(argv[0], optarg);
+                break;
+            case OPT_MAX_HEADERS:
+                HeaderCountMax = parse_size(argv[0], optarg);
+                break;
+            case OPT_CACHE_SIZE:
+                CacheSize = parse_size(argv[0], optarg);
+                break;
+            case OPT_FD_CACHE_SIZE:
+                FdCacheSize = parse_size(argv[0], optarg);
+                break;
+            case OPT_COMPRESS_LEVEL:
+                if (parse_size(argv[0], optarg) > 9) {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                CompressLevel = atoi(optarg);
+                break;
+            case OPT_STATUS:
+                StatusPath = optarg;
+                break;
+            case OPT_CGI_MAX:
+                CgiMax = parse_size(argv[0], optarg);
+                break;
+            case OPT_CGI_MAX_PER_SCRIPT:
+                CgiMaxPerScript = parse_size(argv[0], optarg);
+                break;
+            case OPT_CGI_QUEUE:
+                CgiQueueMax = parse_size(argv[0], optarg);
+                break;
+            case OPT_CGI_QUEUE_TIMEOUT:
+                CgiQueueTimeout = parse_size(argv[0], optarg);
+                break;
+            case OPT_CGI_CACHE:
+                if (cgi_cache_configure(optarg) < 0) {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case OPT_CGI_CACHE_VARY:
+                CgiCacheVary = optarg;
+                break;
+            case OPT_SNAPSHOT:
+                SnapshotMax = parse_size(argv[0], optarg);
+                break;
+            case OPT_FASTCGI:
+                if (fastcgi_configure(optarg) < 0) {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+    }
 
     /* Listen to server socket */
+    if ((sfd = socket_listen(Port)) < 0) {
+        fatal("Unable to listen on port %s", Port);
+    }
 
     /* Determine real RootPath */
+    if ((RootPath = realpath(RootPath, NULL)) == NULL) {
+        fatal("Unable to determine real root path: %s", strerror(errno));
+    }
+    if ((RootFd = open(RootPath, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fatal("Unable to open root path: %s", strerror(errno));
+    }
+
+    /* Ignore SIGPIPE, so writing to a client that went away only fails that
+     * request (with EPIPE) instead of killing the process (scripts and
+     * workers get the default action back) */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Start FastCGI worker pools (before any thread is started, since this
+     * forks the pool manager) */
+    if (fastcgi_start() < 0) {
+        fatal("Unable to start FastCGI workers");
+    }
+
+    /* Prepare request handlers (error responses) */
+    handler_start();
+
+    /* Load site snapshot (before any other thread is started, since its
+     * reload thread must be the only one to receive SIGHUP) */
+    if (SnapshotMax > 0 && snapshot_start() < 0) {
+        fatal("Unable to load snapshot of %s", RootPath);
+    }
+
+    /* Start CGI concurrency limiter (shared by all server processes) */
+    if (limiter_start() < 0) {
+        log("CGI concurrency limits disabled");
+    }
+
+    /* Start descriptor cache invalidation (forked children exit after one
+     * request, so they would only fill a cache nobody else can use) */
+    if (ConcurrencyMode == FORKING) {
+        FdCacheSize = 0;
+    }
+    if (fdcache_start() < 0) {
+        log("Descriptor cache disabled");
+    }
+
+    /* Start background client name resolver */
+    if (ResolveHosts && resolver_start() < 0) {
+        ResolveHosts = false;
+    }
 
     log("Listening on port %s", Port);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", ConcurrencyMode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", ConcurrencyMode == SINGLE ? "Single" : ConcurrencyMode == FORKING ? "Forking" : "Threaded");
 
-    /* Start either forking or single HTTP server */
+    /* Start forking, threaded, or single HTTP server */
+    if (ConcurrencyMode == FORKING) {
+        forking_server(sfd);
+    } else if (ConcurrencyMode == THREADED) {
+        threaded_server(sfd);
+    } else {
+        single_server(sfd);
+    }
     return EXIT_SUCCESS;
 }
 
@@ -6,8 +6,12 @@
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <zlib.h>
+
 /* Constants */
 
 #define WHITESPACE	" \t\n"
@@ -18,6 +22,7 @@
 typedef enum {
     SINGLE,     /**< Single connection */
     FORKING,    /**< Process per connection */
+    THREADED,   /**< Thread per connection */
     UNKNOWN
 } mode;
 
@@ -27,6 +32,22 @@ extern char *Port;                  /**< Port number */
 extern char *MimeTypesPath;         /**< Path to mime.types file */
 extern char *DefaultMimeType;       /**< Default file mimetype */
 extern char *RootPath;              /**< Path to root directory */
+extern int   RootFd;                /**< Descriptor for root directory */
+extern bool  ResolveHosts;          /**< Resolve client names for logging */
+extern size_t RequestLineMax;       /**< Maximum request line length */
+extern size_t HeaderLineMax;        /**< Maximum length of a single header */
+extern size_t HeaderBytesMax;       /**< Maximum size of all headers */
+extern size_t HeaderCountMax;       /**< Maximum number of headers */
+extern size_t CacheSize;            /**< Hot file cache budget in bytes */
+extern size_t FdCacheSize;          /**< Open descriptors to cache */
+extern int   CompressLevel;         /**< On-the-fly compression level (0 disables) */
+extern size_t CgiMax;               /**< CGI scripts running at once (0 unlimited) */
+extern size_t CgiMaxPerScript;      /**< Instances of one script running at once */
+extern size_t CgiQueueMax;          /**< Requests queued per script */
+extern size_t CgiQueueTimeout;      /**< Seconds a request may be queued */
+extern char *CgiCacheVary;          /**< Request headers CGI responses vary by */
+extern char *StatusPath;            /**< URI of server status page */
+extern size_t SnapshotMax;          /**< Largest file kept in site snapshot (0 disables) */
 
 /* Logging Macros */
 
@@ -39,6 +60,79 @@ extern char *RootPath;              /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* HTTP Status */
+
+typedef enum {
+    HTTP_STATUS_OK,			/* 200 OK */
+    HTTP_STATUS_PARTIAL_CONTENT,	/* 206 Partial Content */
+    HTTP_STATUS_MOVED_PERMANENTLY,	/* 301 Moved Permanently */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
+    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
+    HTTP_STATUS_FORBIDDEN,		/* 403 Forbidden */
+    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_METHOD_NOT_ALLOWED,	/* 405 Method Not Allowed */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
+    HTTP_STATUS_URI_TOO_LONG,		/* 414 URI Too Long */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
+    HTTP_STATUS_HEADERS_TOO_LARGE,	/* 431 Request Header Fields Too Large */
+    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_MAX			/* Number of statuses */
+} http_status;
+
+/* Connection I/O */
+
+#define CONN_BUFSIZ	8192	/* Read-ahead and output buffer size */
+#define CONN_IOV_MAX	16	/* Pending output segments before flushing */
+
+struct conn {
+    int		 fd;			/*< Connection file descriptor */
+    char	 rbuf[CONN_BUFSIZ];	/*< Read-ahead buffer */
+    size_t	 rpos;			/*< Start of unconsumed read-ahead */
+    size_t	 rlen;			/*< End of read-ahead */
+    char	 wbuf[CONN_BUFSIZ];	/*< Output buffer */
+    size_t	 wlen;			/*< Bytes used in output buffer */
+    struct iovec iov[CONN_IOV_MAX];	/*< Pending output segments */
+    int		 iovcnt;		/*< Number of pending segments */
+    int		 iovpos;		/*< First segment not yet written */
+};
+
+void		    conn_init(struct conn *c, int fd);
+ssize_t		    conn_fill(struct conn *c);
+ssize_t		    conn_read(struct conn *c, void *data, size_t n);
+int		    conn_write(struct conn *c, const void *data, size_t n);
+int		    conn_printf(struct conn *c, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int		    conn_writev(struct conn *c, const struct iovec *iov, int n);
+int		    conn_flush(struct conn *c);
+ssize_t		    conn_sendfile(struct conn *c, int fd, off_t *offset, size_t count);
+int		    conn_wait(struct conn *c, short events);
+
+/* HTTP Request Parser */
+
+typedef enum {
+    PARSE_NEED_MORE,	/* Request head incomplete: feed more bytes */
+    PARSE_DONE,		/* Request head complete */
+    PARSE_ERROR,	/* Request head malformed */
+} parse_status;
+
+typedef enum {
+    PARSER_REQUEST_LINE,
+    PARSER_HEADERS,
+    PARSER_DONE,
+    PARSER_ERROR,
+} parser_state;
+
+struct parser {
+    parser_state   state;	/*< Current parser state */
+    char	  *line;	/*< Partial line accumulated so far */
+    size_t	   length;	/*< Bytes in partial line */
+    size_t	   capacity;	/*< Capacity of line buffer */
+    size_t	   total;	/*< Header section bytes consumed */
+    size_t	   count;	/*< Headers parsed */
+    http_status    status;	/*< Error status to respond with */
+    struct header *tail;	/*< Last parsed header */
+};
+
 /* HTTP Request */
 
 struct header {
@@ -50,21 +144,31 @@ struct header {
 
 struct request {
     int   fd;               /*< Client socket file descripter */
-    FILE *file;             /*< Client socket file stream */
+    struct conn conn;       /*< Client socket connection buffers */
     char *method;           /*< HTTP method */
     char *uri;              /*< HTTP uniform resource identifier */
     char *path;             /*< Real path corrsponding to URI and RootPath */
+    struct fd_entry *file;  /*< Open descriptor cache entry for path */
+    int   pathfd;           /*< Descriptor for path (owned by file, or -1) */
+    struct stat st;         /*< Status of path */
     char *query;            /*< HTTP query string */
+    int   version;          /*< HTTP version (10 = HTTP/1.0, 11 = HTTP/1.1) */
 
     char host[NI_MAXHOST];
     char port[NI_MAXSERV];
 
     struct header *headers; /*< List of name, value pairs */
+    struct parser  parser;  /*< Incremental request parser */
 };
 
 struct request *    accept_request(int sfd);
 void		    free_request(struct request *request);
 int		    parse_request(struct request *request);
+const char *	    request_header(struct request *request, const char *name);
+int		    request_content_length(struct request *request, size_t *length);
+
+parse_status	    parser_feed(struct parser *p, struct request *r, const char *data, size_t n, size_t *used);
+void		    parser_free(struct parser *p);
 
 /* HTTP Request Handlers */
 
@@ -75,14 +179,115 @@ typedef enum {
     REQUEST_BAD,
 } request_type;
 
-typedef enum {
-    HTTP_STATUS_OK,			/* 200 OK */
-    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
-    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
-    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
-} http_status;
-
+void		    handler_start(void);
 http_status	    handle_request(struct request *request);
+http_status	    handle_error(struct request *request, http_status status);
+int		    cgi_cache_configure(const char *spec);
+char **		    cgi_environment(struct request *request);
+size_t		    cgi_head_length(const char *buffer, size_t n);
+const char *	    cgi_head_value(const char *head, size_t n, const char *name, size_t *length);
+
+/* Hot File Cache */
+
+struct cache_entry {
+    char	       *key;		/*< Cache key (e.g. resolved path) */
+    size_t		hash;		/*< Hash of key */
+    dev_t		dev;		/*< Validators: device, inode, */
+    ino_t		ino;		/*<   size, and modification time */
+    off_t		size;
+    struct timespec	mtime;
+    time_t		expires;	/*< Expiration time (0 never) */
+    char	       *data;		/*< Cached contents */
+    size_t		length;		/*< Length of contents */
+    char	       *type;		/*< Content type (may be NULL) */
+    size_t		refs;		/*< References (cache and readers) */
+    bool		referenced;	/*< CLOCK reference bit */
+    struct cache_entry *next;		/*< Hash chain */
+    struct cache_entry *clock_next;	/*< CLOCK ring */
+    struct cache_entry *clock_prev;
+    struct cache_entry *retired;	/*< Retired list */
+};
+
+struct cache_entry *cache_lookup(const char *key, const struct stat *st);
+struct cache_entry *cache_insert(const char *key, const struct stat *st, int fd, const char *type);
+struct cache_entry *cache_insert_data(const char *key, const struct stat *st, char *data, size_t length, const char *type, time_t expires);
+bool		    cache_fits(size_t length);
+void		    cache_release(struct cache_entry *e);
+void		    cache_write_status(struct conn *c);
+
+/* On-the-fly Compression */
+
+#define COMPRESS_MIN	1024	/* Smaller bodies are not worth compressing */
+
+struct compressor {
+    z_stream	 stream;		/*< zlib deflate state */
+    struct conn *conn;			/*< Connection to write output to */
+    char	 out[CONN_BUFSIZ];	/*< Compressed output */
+};
+
+const char *	    compress_coding(const char *accept);
+bool		    compress_type(const char *type);
+char *		    compress_buffer(const void *data, size_t n, const char *coding, size_t *length);
+int		    compress_start(struct compressor *z, struct conn *c, const char *coding);
+int		    compress_write(struct compressor *z, const void *data, size_t n);
+int		    compress_finish(struct compressor *z);
+
+/* Open File Descriptor Cache */
+
+struct fd_entry {
+    char	    *key;		/*< Path relative to RootPath */
+    size_t	     hash;		/*< Hash of key */
+    int		     fd;		/*< Open descriptor (shared: use offsets) */
+    int		     error;		/*< Open error (negative entry, fd is -1) */
+    struct stat	     st;		/*< Status of descriptor */
+    char	    *type;		/*< Mimetype (determined on first use) */
+    size_t	     refs;		/*< References (cache and requests) */
+    bool	     cached;		/*< Linked into cache */
+    struct fd_entry *next;		/*< Hash chain */
+    struct fd_entry *lru_next;		/*< Recently used list */
+    struct fd_entry *lru_prev;
+};
+
+int		    fdcache_start(void);
+struct fd_entry *   fdcache_open(const char *relative);
+void		    fdcache_release(struct fd_entry *e);
+const char *	    fdcache_mimetype(struct fd_entry *e, const char *path);
+void		    fdcache_write_status(struct conn *c);
+
+/* FastCGI Worker Pool */
+
+struct fastcgi_pool;
+
+int		    fastcgi_configure(const char *spec);
+int		    fastcgi_start(void);
+struct fastcgi_pool *fastcgi_lookup(const char *relative);
+http_status	    fastcgi_handle(struct fastcgi_pool *pool, struct request *request);
+void		    fastcgi_write_status(struct conn *c);
+
+/* CGI Concurrency Limiter */
+
+struct limiter_script;
+
+int		    limiter_start(void);
+struct limiter_script *limiter_acquire(const char *key);
+void		    limiter_release(struct limiter_script *s);
+void		    limiter_write_status(struct conn *c);
+
+/* Request Coalescing */
+
+struct flight;
+
+struct flight *	    flight_join(const char *key, bool *leader);
+void		    flight_finish(struct flight *f, char *data, size_t length);
+const char *	    flight_result(struct flight *f, size_t *length);
+void		    flight_release(struct flight *f);
+void		    flight_write_status(struct conn *c);
+
+/* In-Memory Site Snapshot */
+
+int		    snapshot_start(void);
+bool		    snapshot_handle(struct request *request, http_status *status);
+void		    snapshot_write_status(struct conn *c);
 
 /* HTTP Server */
 
@@ -90,22 +295,86 @@ void		    single_server(int sfd);
 void		    forking_server(int sfd);
 void		    threaded_server(int sfd);
 
+/* Client Name Resolver */
+
+int		    resolver_start(void);
+bool		    resolver_lookup(const struct sockaddr *addr, socklen_t addrlen, const char *host, char *name, size_t n);
+
 /* Socket */
 
 int		    socket_listen(const char *port);
 
 /* Utilities */
 
+#define RANGES_MAX  16      /* Byte ranges served per request */
+#define ETAG_MAX    64      /* Maximum length of formatted entity tag */
+#define DATE_MAX    32      /* Maximum length of formatted HTTP date */
+#define DATE_LENGTH 29      /* Length of IMF-fixdate (e.g. "Sun, 06 Nov 1994 08:49:37 GMT") */
+
+struct range {
+    off_t first;            /*< First byte of range */
+    off_t last;             /*< Last byte of range (inclusive) */
+};
+
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+bool		    accepts_encoding(const char *value, const char *coding);
 char *		    determine_mimetype(const char *path);
-char *		    determine_request_path(const char *uri);
-request_type	    determine_request_type(const char *path);
+bool		    etag_matches(const char *list, const char *etag, bool strong);
+char *		    determine_request_path(const char *uri, struct fd_entry **file);
+request_type	    determine_request_type(const struct stat *s);
+int		    escape_html(const char *s, char *buffer, size_t n);
+int		    escape_uri(const char *s, char *buffer, size_t n);
+void		    format_etag(const struct stat *st, char *buffer, size_t n);
+void		    format_http_date(time_t t, char *buffer, size_t n);
 const char *        http_status_string(http_status status);
+int		    normalize_uri(const char *uri, char *path, size_t n);
+time_t		    parse_http_date(const char *s);
+int		    parse_number(const char *s, size_t *value);
+const char *	    query_param(const char *query, const char *name, char *buffer, size_t n);
+int		    parse_ranges(const char *value, off_t size, struct range *ranges, size_t n);
+int		    open_beneath(const char *relative);
 char *		    skip_nonwhitespace(char *s);
 char *		    skip_whitespace(char *s);
 
+/* Response Head Builder */
+
+#define NUMBER_MAX  24      /* Maximum length of formatted number */
+
+typedef enum {
+    HEADER_ACCEPT_RANGES,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_ENCODING,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_RANGE,
+    HEADER_CONTENT_TYPE,
+    HEADER_DATE,
+    HEADER_ETAG,
+    HEADER_LAST_MODIFIED,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_VARY,
+    HEADER_MAX				/* Number of known headers */
+} header_name;
+
+struct head {
+    char   *buffer;         /*< Caller-provided buffer */
+    size_t  size;           /*< Size of buffer */
+    size_t  length;         /*< Length of head (may exceed size) */
+    size_t  date;           /*< Offset of Date value */
+};
+
+size_t		    format_number(char *buffer, unsigned long long value);
+void		    format_http_now(char *buffer, size_t n);
+void		    head_start(struct head *h, char *buffer, size_t n, http_status status, int version);
+void		    head_append(struct head *h, const char *data, size_t n);
+void		    head_append_number(struct head *h, unsigned long long value);
+void		    head_add(struct head *h, header_name name, const char *value);
+void		    head_add_number(struct head *h, header_name name, unsigned long long value);
+void		    head_add_range(struct head *h, const struct range *range, off_t size);
+ssize_t		    head_finish(struct head *h);
+int		    head_write(struct head *h, struct conn *c);
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
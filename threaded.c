@@ -0,0 +1,57 @@
+/* threaded.c: Threaded HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/**
+ * Handle and free one HTTP request (thread entry point).
+ **/
+static void *
+threaded_handler(void *arg)
+{
+    struct request *request = arg;
+
+    handle_request(request);
+    free_request(request);
+    return NULL;
+}
+
+/**
+ * Spawn a detached thread for each incoming HTTP request.
+ *
+ * Unlike forking mode, all requests share the server's memory (and thus its
+ * caches).
+ **/
+void
+threaded_server(int sfd)
+{
+    struct request *request;
+    pthread_t thread;
+    int status;
+
+    /* Accept and handle HTTP request */
+    while (true) {
+        /* Accept request */
+        if ((request = accept_request(sfd)) == NULL) {
+            continue;
+        }
+
+        /* Spawn thread to handle request */
+        if ((status = pthread_create(&thread, NULL, threaded_handler, request)) != 0) {
+            fprintf(stderr, "Unable to create thread: %s\n", strerror(status));
+            free_request(request);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    /* Close server socket and exit */
+    close(sfd);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,11 +4,59 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+/* Internal Declarations */
+static int hex_value(int c);
+
+/**
+ * Determine whether Accept-Encoding value allows content coding.
+ *
+ * The coding is acceptable if it (or "*") is listed without a zero quality
+ * value, e.g. "gzip, deflate, br" or "br;q=1.0, gzip;q=0.5", but not
+ * "gzip;q=0".
+ **/
+bool
+accepts_encoding(const char *value, const char *coding)
+{
+    size_t length = strlen(coding);
+    bool wildcard = false;
+
+    for (const char *c = value; *c; ) {
+        const char *token;
+        size_t n;
+        bool rejected = false;
+
+        for (; *c == ' ' || *c == '\t' || *c == ','; c++);
+        for (token = c; *c && *c != ',' && *c != ';' && *c != ' ' && *c != '\t'; c++);
+        n = c - token;
+
+        /* Check parameters for q=0 */
+        for (; *c && *c != ','; c++) {
+            if ((*c == 'q' || *c == 'Q') && c[1] == '=') {
+                rejected = strtod(c + 2, NULL) <= 0.0;
+            }
+        }
+
+        if (n == length && strncasecmp(token, coding, length) == 0) {
+            return !rejected;
+        }
+        if (n == 1 && *token == '*') {
+            wildcard = !rejected;
+        }
+    }
+    return wildcard;
+}
+
 /**
  * Determine mime-type from file extension
  *
@@ -34,15 +82,37 @@ determine_mimetype(const char *path)
     char *ext;
     char *mimetype;
     char *token;
+    char *state;
     char buffer[BUFSIZ];
     FILE *fs = NULL;
-    
+
     /* Find file extension */
+    if ((ext = strrchr(path, '.')) == NULL || strchr(ext, '/') != NULL) {
+        goto fail;
+    }
+    ext++;
 
     /* Open MimeTypesPath file */
+    if ((fs = fopen(MimeTypesPath, "r")) == NULL) {
+        debug("Unable to open %s: %s", MimeTypesPath, strerror(errno));
+        goto fail;
+    }
 
     /* Scan file for matching file extensions */
-   
+    while (fgets(buffer, BUFSIZ, fs)) {
+        if (buffer[0] == '#') {
+            continue;
+        }
+        if ((mimetype = strtok_r(buffer, WHITESPACE, &state)) == NULL) {
+            continue;
+        }
+        while ((token = strtok_r(NULL, WHITESPACE, &state)) != NULL) {
+            if (streq(token, ext)) {
+                goto done;
+            }
+        }
+    }
+
 fail:
     mimetype = DefaultMimeType;
 
@@ -53,32 +123,200 @@ done:
     return strdup(mimetype);
 }
 
+/**
+ * Decode and lexically normalize URI path
+ *
+ * In a single pass over the URI, this function percent-decodes each character
+ * and builds the normalized path relative to RootPath:
+ *
+ *  1. Empty segments (i.e. "//") and "." segments are dropped.
+ *  2. ".." segments remove the previous segment.
+ *
+ * The result never begins or ends with "/" ("." for the root itself).
+ *
+ * Returns the length of the normalized path, or -1 if the URI is malformed
+ * (bad percent escape or encoded NUL), too long for the buffer, or if a ".."
+ * would escape the root.
+ **/
+int
+normalize_uri(const char *uri, char *path, size_t n)
+{
+    size_t length  = 0;     /* Length of normalized path */
+    size_t segment = 0;     /* Start of current segment */
+    const char *s  = uri;
+
+    if (n < 2) {
+        return -1;
+    }
+
+    while (true) {
+        int c = (unsigned char)*s;
+
+        /* Decode next character (end of string finishes the last segment) */
+        if (c == '%') {
+            int hi = hex_value(s[1]);
+            int lo = hi < 0 ? -1 : hex_value(s[2]);
+            if (lo < 0 || (c = (hi << 4) | lo) == 0) {
+                return -1;
+            }
+            s += 3;
+        } else if (c != '\0') {
+            s += 1;
+        }
+
+        if (c != '/' && c != '\0') {
+            if (length + 1 >= n) {
+                return -1;
+            }
+            path[length++] = c;
+            continue;
+        }
+
+        /* End of segment */
+        size_t size = length - segment;
+        if (size == 1 && path[segment] == '.') {
+            length = segment;
+        } else if (size == 2 && path[segment] == '.' && path[segment + 1] == '.') {
+            if (segment == 0) {
+                return -1;
+            }
+            length = segment - 1;
+            while (length > 0 && path[length - 1] != '/') {
+                length--;
+            }
+        } else if (size > 0 && c != '\0') {
+            if (length + 1 >= n) {
+                return -1;
+            }
+            path[length++] = '/';
+        }
+        segment = length;
+
+        if (c == '\0') {
+            break;
+        }
+    }
+
+    /* Strip trailing separator */
+    if (length > 0 && path[length - 1] == '/') {
+        length--;
+    }
+    if (length == 0) {
+        path[length++] = '.';
+    }
+    path[length] = '\0';
+    return length;
+}
+
+/**
+ * Open normalized path relative to RootFd without escaping RootPath.
+ *
+ * This uses openat2(2) with RESOLVE_BENEATH, which has the kernel walk the
+ * path in one syscall while refusing any component (including symlinks) that
+ * resolves outside of RootPath.  Files that are not readable (e.g. execute
+ * only scripts) are opened with O_PATH instead.
+ *
+ * If openat2 is not available, this falls back to realpath(3) and checks that
+ * the real path begins with RootPath.
+ *
+ * Returns file descriptor on success, -1 on error.
+ **/
+int
+open_beneath(const char *relative)
+{
+    static bool NoOpenat2 = false;
+    int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+    int fd;
+
+#ifdef SYS_openat2
+    if (!NoOpenat2) {
+        struct open_how how = {
+            .flags   = flags,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+        };
+
+        if ((fd = syscall(SYS_openat2, RootFd, relative, &how, sizeof(how))) < 0 && errno == EACCES) {
+            how.flags = O_PATH | O_CLOEXEC;
+            fd = syscall(SYS_openat2, RootFd, relative, &how, sizeof(how));
+        }
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        NoOpenat2 = true;
+    }
+#endif
+
+    char path[PATH_MAX];
+    char real[PATH_MAX];
+    size_t n = strlen(RootPath);
+
+    snprintf(path, sizeof(path), "%s/%s", RootPath, relative);
+    if (realpath(path, real) == NULL) {
+        return -1;
+    }
+    if (strncmp(real, RootPath, n) != 0 || (real[n] != '\0' && real[n] != '/')) {
+        errno = EACCES;
+        return -1;
+    }
+    if ((fd = open(real, flags)) < 0 && errno == EACCES) {
+        fd = open(real, O_PATH | O_CLOEXEC);
+    }
+    return fd;
+}
+
 /**
  * Determine actual filesystem path based on RootPath and URI
  *
- * This function uses realpath(3) to generate the realpath of the
- * file requested in the URI.
+ * This function decodes and normalizes the URI lexically (see normalize_uri)
+ * and then opens the result beneath RootPath (see open_beneath), which
+ * guarantees the path cannot escape RootPath, even through symlinks.  The
+ * open goes through the descriptor cache (see fdcache_open), so a hot path
+ * costs no syscalls at all; a cold one costs openat2 and fstat rather than an
+ * lstat per path component with realpath(3).
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * On success, the descriptor cache entry (holding the opened descriptor and
+ * its status) is stored in file, and a newly allocated string containing the
+ * path is returned.  This string must later be free'd and the entry released.
  *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * Otherwise (including when the full path would not fit in PATH_MAX), return
+ * NULL.
  **/
 char *
-determine_request_path(const char *uri)
+determine_request_path(const char *uri, struct fd_entry **file)
 {
-    char path[BUFSIZ];
-    char real[BUFSIZ];
+    char relative[PATH_MAX];
+    char path[PATH_MAX];
+    int  length;
+
+    if (normalize_uri(uri, relative, sizeof(relative)) < 0) {
+        debug("Invalid uri: %s", uri);
+        return NULL;
+    }
+
+    if ((*file = fdcache_open(relative)) == NULL) {
+        debug("Unable to open %s: %s", relative, strerror(errno));
+        return NULL;
+    }
 
-    return strdup(real);
+    if (streq(relative, ".")) {
+        length = snprintf(path, sizeof(path), "%s", RootPath);
+    } else {
+        length = snprintf(path, sizeof(path), "%s/%s", RootPath, relative);
+    }
+    if (length >= (int)sizeof(path)) {
+        debug("Path too long: %s/%s", RootPath, relative);
+        fdcache_release(*file);
+        *file = NULL;
+        return NULL;
+    }
+    return strdup(path);
 }
 
 /**
- * Determine request type from path
+ * Determine request type from file status
  *
- * Based on the file specified by path, determine what type of request
- * this is:
+ * Based on the status of the file (as returned by determine_request_path),
+ * determine what type of request this is:
  *
  *  1. REQUEST_BROWSE: Path is a directory.
  *  2. REQUEST_CGI:    Path is an executable file.
@@ -86,25 +324,365 @@ determine_request_path(const char *uri)
  *  4. REQUEST_BAD:    Everything else.
  **/
 request_type
-determine_request_type(const char *path)
+determine_request_type(const struct stat *s)
 {
-    struct stat s;
     request_type type;
 
+    if (S_ISDIR(s->st_mode)) {
+        type = REQUEST_BROWSE;
+    } else if (S_ISREG(s->st_mode) && (s->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+        type = REQUEST_CGI;
+    } else if (S_ISREG(s->st_mode) && (s->st_mode & (S_IRUSR | S_IRGRP | S_IROTH))) {
+        type = REQUEST_FILE;
+    } else {
+        type = REQUEST_BAD;
+    }
+
     return (type);
 }
 
+/* Status lines, indexed by http_status */
+static const char *StatusStrings[HTTP_STATUS_MAX] = {
+    [HTTP_STATUS_OK]			= "200 OK",
+    [HTTP_STATUS_PARTIAL_CONTENT]	= "206 Partial Content",
+    [HTTP_STATUS_MOVED_PERMANENTLY]	= "301 Moved Permanently",
+    [HTTP_STATUS_NOT_MODIFIED]		= "304 Not Modified",
+    [HTTP_STATUS_BAD_REQUEST]		= "400 Bad Request",
+    [HTTP_STATUS_FORBIDDEN]		= "403 Forbidden",
+    [HTTP_STATUS_NOT_FOUND]		= "404 Not Found",
+    [HTTP_STATUS_METHOD_NOT_ALLOWED]	= "405 Method Not Allowed",
+    [HTTP_STATUS_PAYLOAD_TOO_LARGE]	= "413 Payload Too Large",
+    [HTTP_STATUS_URI_TOO_LONG]		= "414 URI Too Long",
+    [HTTP_STATUS_RANGE_NOT_SATISFIABLE]	= "416 Range Not Satisfiable",
+    [HTTP_STATUS_HEADERS_TOO_LARGE]	= "431 Request Header Fields Too Large",
+    [HTTP_STATUS_INTERNAL_SERVER_ERROR]	= "500 Internal Server Error",
+    [HTTP_STATUS_SERVICE_UNAVAILABLE]	= "503 Service Unavailable",
+};
+
 /**
  * Return static string corresponding to HTTP Status code
  *
  * http://en.wikipedia.org/wiki/List_of_HTTP_status_codes
+ *
+ * Unknown statuses are reported as 500 Internal Server Error.
  **/
 const char *
 http_status_string(http_status status)
 {
-    const char *status_string;
+    if ((unsigned)status >= HTTP_STATUS_MAX) {
+        return StatusStrings[HTTP_STATUS_INTERNAL_SERVER_ERROR];
+    }
+    return StatusStrings[status];
+}
+
+/**
+ * Format entity tag for file status into buffer (of at least ETAG_MAX bytes).
+ *
+ * The tag is derived from the inode, size, and modification time, so it
+ * changes whenever the file is replaced or modified.  It is weak (W/) while
+ * the file was modified within the last second, since another write in the
+ * same second might not change the modification time.
+ **/
+void
+format_etag(const struct stat *st, char *buffer, size_t n)
+{
+    bool weak = time(NULL) - st->st_mtim.tv_sec < 1;
+
+    snprintf(buffer, n, "%s\"%llx-%llx-%llx.%lx\"", weak ? "W/" : "",
+        (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+        (unsigned long long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+}
+
+/**
+ * Determine whether entity tag matches any tag in list (an If-None-Match or
+ * If-Range value, where "*" matches everything).
+ *
+ * The strong comparison requires both tags to be strong; the weak comparison
+ * ignores the W/ prefixes.
+ **/
+bool
+etag_matches(const char *list, const char *etag, bool strong)
+{
+    const char *c = list;
+    bool weak = strncmp(etag, "W/", 2) == 0;
+    size_t length;
+
+    if (weak) {
+        if (strong) {
+            return false;
+        }
+        etag += 2;
+    }
+    length = strlen(etag);
+
+    while (*c) {
+        const char *end;
+        bool tag_weak;
+
+        for (; *c == ' ' || *c == '\t' || *c == ','; c++);
+        if (*c == '*') {
+            return true;
+        }
+        if ((tag_weak = strncmp(c, "W/", 2) == 0)) {
+            c += 2;
+        }
+        if (*c != '"' || (end = strchr(c + 1, '"')) == NULL) {
+            return false;
+        }
+        if ((size_t)(end + 1 - c) == length && strncmp(c, etag, length) == 0 && !(strong && tag_weak)) {
+            return true;
+        }
+        c = end + 1;
+    }
+    return false;
+}
+
+/**
+ * Escape string for HTML text or a quoted attribute value (&, <, >, ", and ')
+ * into buffer (of size n).
+ *
+ * Returns the length of the escaped string, or -1 if it does not fit.
+ **/
+int
+escape_html(const char *s, char *buffer, size_t n)
+{
+    size_t length = 0;
+
+    for (; *s; s++) {
+        const char *entity;
+        char        c[2] = {*s, '\0'};
+
+        switch (*s) {
+            case '&':  entity = "&amp;";  break;
+            case '<':  entity = "&lt;";   break;
+            case '>':  entity = "&gt;";   break;
+            case '"':  entity = "&quot;"; break;
+            case '\'': entity = "&#39;";  break;
+            default:   entity = c;        break;
+        }
+        for (; *entity; entity++) {
+            if (length + 1 >= n) {
+                return -1;
+            }
+            buffer[length++] = *entity;
+        }
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+/**
+ * Percent-encode string for a URI path (everything but unreserved characters
+ * and "/") into buffer (of size n).  The result is also safe in a quoted HTML
+ * attribute value.
+ *
+ * Returns the length of the encoded string, or -1 if it does not fit.
+ **/
+int
+escape_uri(const char *s, char *buffer, size_t n)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t length = 0;
+
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' || c == '/') {
+            if (length + 1 >= n) {
+                return -1;
+            }
+            buffer[length++] = c;
+        } else {
+            if (length + 3 >= n) {
+                return -1;
+            }
+            buffer[length++] = '%';
+            buffer[length++] = hex[c >> 4];
+            buffer[length++] = hex[c & 15];
+        }
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+/**
+ * Format time as HTTP date into buffer (of at least DATE_MAX bytes).
+ **/
+void
+format_http_date(time_t t, char *buffer, size_t n)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buffer, n, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * Parse HTTP date (IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT").
+ *
+ * Returns seconds since the epoch on success, -1 on error.
+ **/
+time_t
+parse_http_date(const char *s)
+{
+    struct tm tm = {0};
+    char *end;
+
+    if ((end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL || *skip_whitespace(end) != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/**
+ * Parse unsigned decimal number (digits only: no sign, whitespace, or
+ * trailing characters) into value.
+ *
+ * Returns 0 on success, -1 if the number is malformed or out of range.
+ **/
+int
+parse_number(const char *s, size_t *value)
+{
+    unsigned long long n;
+    char *end;
+
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if (!isdigit((unsigned char)s[0]) || *end != '\0' || errno == ERANGE || n > SIZE_MAX) {
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+/**
+ * Parse byte offset at s into value, advancing s past the digits.
+ *
+ * Returns 0 on success, -1 if there are no digits or the value overflows.
+ **/
+static int
+parse_offset(const char **s, off_t *value)
+{
+    const char *c = *s;
 
-    return status_string;
+    if (!isdigit((unsigned char)*c)) {
+        return -1;
+    }
+    for (*value = 0; isdigit((unsigned char)*c); c++) {
+        if (*value > (INT64_MAX - (*c - '0')) / 10) {
+            return -1;
+        }
+        *value = *value * 10 + (*c - '0');
+    }
+    *s = c;
+    return 0;
+}
+
+/**
+ * Parse Range header value for a representation of size bytes
+ *
+ * Each satisfiable range (e.g. "bytes=0-499", "bytes=500-", or the suffix
+ * "bytes=-500") is clamped to the representation and stored in ranges, which
+ * has room for n of them; unsatisfiable ones are dropped.
+ *
+ * Returns the number of satisfiable ranges (0 means 416 Range Not
+ * Satisfiable), or -1 if the header is malformed, uses another unit, or asks
+ * for more than n ranges, in which case it should be ignored and the whole
+ * representation served.
+ **/
+int
+parse_ranges(const char *value, off_t size, struct range *ranges, size_t n)
+{
+    const char *c = value;
+    size_t count = 0;
+    size_t specs = 0;
+
+    if (strncasecmp(c, "bytes", 5) != 0) {
+        return -1;
+    }
+    for (c += 5; *c == ' ' || *c == '\t'; c++);
+    if (*c++ != '=') {
+        return -1;
+    }
+
+    while (true) {
+        off_t first = -1;
+        off_t last  = -1;
+
+        for (; *c == ' ' || *c == '\t'; c++);
+        if (*c == ',') {            /* Empty list elements are allowed */
+            c++;
+            continue;
+        }
+        if (*c == '\0') {
+            break;
+        }
+
+        if (*c == '-') {            /* Suffix range: last n bytes */
+            c++;
+            if (parse_offset(&c, &last) < 0) {
+                return -1;
+            }
+        } else {
+            if (parse_offset(&c, &first) < 0 || *c++ != '-') {
+                return -1;
+            }
+            if (isdigit((unsigned char)*c) && parse_offset(&c, &last) < 0) {
+                return -1;
+            }
+            if (last >= 0 && last < first) {
+                return -1;
+            }
+        }
+
+        for (; *c == ' ' || *c == '\t'; c++);
+        if (*c != ',' && *c != '\0') {
+            return -1;
+        }
+        if (++specs > n) {
+            return -1;
+        }
+
+        /* Clamp satisfiable ranges to representation */
+        if (first < 0) {
+            if (last > 0 && size > 0) {
+                ranges[count].first = last < size ? size - last : 0;
+                ranges[count].last  = size - 1;
+                count++;
+            }
+        } else if (first < size) {
+            ranges[count].first = first;
+            ranges[count].last  = last >= 0 && last < size ? last : size - 1;
+            count++;
+        }
+    }
+
+    return specs > 0 ? (int)count : -1;
+}
+
+/**
+ * Lookup parameter in query string (e.g. "limit" in "offset=10&limit=50") and
+ * copy its raw value (up to the next '&') into buffer (of size n).  A value
+ * too long for the buffer is copied as "", so it never validates.
+ *
+ * Returns buffer, or NULL if the query does not have the parameter.
+ **/
+const char *
+query_param(const char *query, const char *name, char *buffer, size_t n)
+{
+    size_t length = strlen(name);
+
+    while (query && *query) {
+        if (strncmp(query, name, length) == 0 && query[length] == '=') {
+            size_t value = strcspn(query + length + 1, "&");
+            snprintf(buffer, n, "%.*s", value < n ? (int)value : 0, query + length + 1);
+            return buffer;
+        }
+        if ((query = strchr(query, '&'))) {
+            query++;
+        }
+    }
+    return NULL;
 }
 
 /**
@@ -113,6 +691,10 @@ http_status_string(http_status status)
 char *
 skip_nonwhitespace(char *s)
 {
+    while (s[0] != '\0' && s[0] != ' ' && s[0] != '\t' && s[0] != '\n')
+    {
+        s += 1;
+    }
     return s;
 }
 
@@ -130,4 +712,16 @@ skip_whitespace(char *s)
     return s;
 }
 
+/**
+ * Return value of hexadecimal digit (or -1 if c is not a hexadecimal digit)
+ **/
+static int
+hex_value(int c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */